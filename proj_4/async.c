@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* An async ring modeled on io_uring. The caller fills entries from
+ * sfs_ring_get_sqe and publishes them with sfs_ring_submit; a pool of worker
+ * threads runs them and posts results to the completion ring, tagged with the
+ * entry's user_data. Completions can arrive in any order. Entries are fetched,
+ * submitted and reaped from a single thread.
+ * SFS isn't thread safe, so workers take turns running operations under
+ * fs_lock. Don't use the synchronous API on the disk while the ring is up. */
+struct sfs_ring {
+        struct sfs_disk* disk;
+        struct sfs_sqe sq[SFS_RING_SIZE];
+        struct sfs_cqe cq[SFS_RING_SIZE];
+        unsigned sq_head;               // next entry a worker takes
+        unsigned sq_tail;               // end of the submitted entries
+        unsigned sq_pending;            // end of the entries handed out by sfs_ring_get_sqe
+        unsigned cq_head;               // next completion to reap
+        unsigned cq_tail;               // end of the posted completions
+        int stop;                       // tells the workers to exit
+        pthread_mutex_t lock;           // protects the ring indices
+        pthread_mutex_t fs_lock;        // held while running an operation
+        pthread_cond_t sq_ready;        // signals workers that entries were submitted
+        pthread_cond_t cq_ready;        // signals the caller that a completion was posted
+        pthread_t* workers;
+        int num_workers;
+};
+
+/* Run a read or write. With an offset it works like pread/pwrite and leaves
+ * the descriptor's offset where it was; with offset -1 it starts at the
+ * current offset and moves it along. */
+static int sfs_ring_rw(struct sfs_disk* disk, struct sfs_sqe* sqe)
+{
+        int ret;
+        if(sqe->offset < 0) {
+                if(sqe->op == SFS_OP_READ) return sfs_read(disk, sqe->filedes, sqe->buf, sqe->nbytes);
+                return sfs_write(disk, sqe->filedes, sqe->buf, sqe->nbytes);
+        }
+        if(sfs_seek(disk, sqe->filedes, 0, SEEK_CUR) != 0) return -1; // checks the descriptor
+        struct sfs_open_file* file = &disk->open_list[sqe->filedes];
+        int saved = file->cur_offset;
+        if(sfs_seek(disk, sqe->filedes, sqe->offset, SEEK_SET) != 0) return -1;
+        if(sqe->op == SFS_OP_READ) ret = sfs_read(disk, sqe->filedes, sqe->buf, sqe->nbytes);
+        else ret = sfs_write(disk, sqe->filedes, sqe->buf, sqe->nbytes);
+        file->cur_offset = saved;
+        return ret;
+}
+
+/* Run one submitted operation and return its result. */
+static int sfs_ring_execute(struct sfs_disk* disk, struct sfs_sqe* sqe)
+{
+        switch(sqe->op) {
+                case SFS_OP_OPEN:
+                        return sfs_open(disk, sqe->filename, sqe->create_flag);
+                case SFS_OP_READ:
+                case SFS_OP_WRITE:
+                        return sfs_ring_rw(disk, sqe);
+                case SFS_OP_CLOSE:
+                        return sfs_close(disk, sqe->filedes);
+                default:
+                        printf("ERROR: unknown async operation %d\n", sqe->op);
+                        return -1;
+        }
+}
+
+/* Worker thread: take submitted entries, run them, and post completions. */
+static void* sfs_ring_worker(void* arg)
+{
+        struct sfs_ring* ring = arg;
+        struct sfs_sqe sqe;
+        struct sfs_cqe cqe;
+        pthread_mutex_lock(&ring->lock);
+        while(1) {
+                while(ring->sq_head == ring->sq_tail && !ring->stop) {
+                        pthread_cond_wait(&ring->sq_ready, &ring->lock);
+                }
+                if(ring->sq_head == ring->sq_tail) break; // stopping and nothing left to run
+                sqe = ring->sq[ring->sq_head % SFS_RING_SIZE];
+                ring->sq_head++;
+                pthread_mutex_unlock(&ring->lock);
+
+                pthread_mutex_lock(&ring->fs_lock);
+                cqe.result = sfs_ring_execute(ring->disk, &sqe);
+                pthread_mutex_unlock(&ring->fs_lock);
+                cqe.user_data = sqe.user_data;
+
+                // sfs_ring_get_sqe keeps at most SFS_RING_SIZE operations unreaped, so there is room
+                pthread_mutex_lock(&ring->lock);
+                ring->cq[ring->cq_tail % SFS_RING_SIZE] = cqe;
+                ring->cq_tail++;
+                pthread_cond_signal(&ring->cq_ready);
+        }
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+}
+
+/* Set up an async ring for a disk with `workers` worker threads.
+ * Returns the ring, or NULL on failure. */
+struct sfs_ring* sfs_ring_init(struct sfs_disk* disk, int workers)
+{
+        if(workers <= 0) {
+                printf("ERROR: async ring needs at least one worker!\n");
+                return NULL;
+        }
+        struct sfs_ring* ring = calloc(1, sizeof(struct sfs_ring));
+        pthread_t* threads = calloc(workers, sizeof(pthread_t));
+        if(ring == NULL || threads == NULL) {
+                printf("ERROR: can't allocate async ring!\n");
+                free(ring);
+                free(threads);
+                return NULL;
+        }
+        ring->disk = disk;
+        ring->workers = threads;
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_mutex_init(&ring->fs_lock, NULL);
+        pthread_cond_init(&ring->sq_ready, NULL);
+        pthread_cond_init(&ring->cq_ready, NULL);
+        for(int i=0; i < workers; i++) {
+                if(pthread_create(&ring->workers[i], NULL, sfs_ring_worker, ring) != 0) {
+                        printf("ERROR: can't start async worker thread!\n");
+                        break;
+                }
+                ring->num_workers++;
+        }
+        if(ring->num_workers == 0) {
+                sfs_ring_exit(ring);
+                return NULL;
+        }
+        return ring;
+}
+
+/* Run any submitted operations, stop the workers and free the ring. Unreaped
+ * completions are dropped. */
+void sfs_ring_exit(struct sfs_ring* ring)
+{
+        pthread_mutex_lock(&ring->lock);
+        ring->stop = 1;
+        pthread_cond_broadcast(&ring->sq_ready);
+        pthread_mutex_unlock(&ring->lock);
+        for(int i=0; i < ring->num_workers; i++) {
+                pthread_join(ring->workers[i], NULL);
+        }
+        pthread_mutex_destroy(&ring->lock);
+        pthread_mutex_destroy(&ring->fs_lock);
+        pthread_cond_destroy(&ring->sq_ready);
+        pthread_cond_destroy(&ring->cq_ready);
+        free(ring->workers);
+        free(ring);
+}
+
+/* Return the next free submission entry to fill in, or NULL if SFS_RING_SIZE
+ * operations are already waiting to be run or reaped. The entry isn't run
+ * until sfs_ring_submit. */
+struct sfs_sqe* sfs_ring_get_sqe(struct sfs_ring* ring)
+{
+        pthread_mutex_lock(&ring->lock);
+        int full = ring->sq_pending - ring->cq_head >= SFS_RING_SIZE;
+        pthread_mutex_unlock(&ring->lock);
+        if(full) return NULL;
+        struct sfs_sqe* sqe = &ring->sq[ring->sq_pending % SFS_RING_SIZE];
+        memset(sqe, 0, sizeof(struct sfs_sqe));
+        sqe->offset = -1;
+        ring->sq_pending++;
+        return sqe;
+}
+
+/* Hand the entries filled in since the last submit to the workers.
+ * Returns the number of entries submitted. */
+int sfs_ring_submit(struct sfs_ring* ring)
+{
+        pthread_mutex_lock(&ring->lock);
+        int submitted = ring->sq_pending - ring->sq_tail;
+        ring->sq_tail = ring->sq_pending;
+        if(submitted == 1) pthread_cond_signal(&ring->sq_ready);
+        else if(submitted > 1) pthread_cond_broadcast(&ring->sq_ready);
+        pthread_mutex_unlock(&ring->lock);
+        return submitted;
+}
+
+/* Wait for the next completion and copy it into `cqe`.
+ * Returns 0, or -1 if no operations are outstanding. */
+int sfs_ring_wait_cqe(struct sfs_ring* ring, struct sfs_cqe* cqe)
+{
+        pthread_mutex_lock(&ring->lock);
+        if(ring->cq_head == ring->sq_tail) { // nothing submitted is left to complete
+                pthread_mutex_unlock(&ring->lock);
+                return -1;
+        }
+        while(ring->cq_head == ring->cq_tail) {
+                pthread_cond_wait(&ring->cq_ready, &ring->lock);
+        }
+        *cqe = ring->cq[ring->cq_head % SFS_RING_SIZE];
+        ring->cq_head++;
+        pthread_mutex_unlock(&ring->lock);
+        return 0;
+}
+
+/* Copy the next completion into `cqe` without waiting.
+ * Returns 0, or -1 if no completion is ready. */
+int sfs_ring_peek_cqe(struct sfs_ring* ring, struct sfs_cqe* cqe)
+{
+        pthread_mutex_lock(&ring->lock);
+        if(ring->cq_head == ring->cq_tail) {
+                pthread_mutex_unlock(&ring->lock);
+                return -1;
+        }
+        *cqe = ring->cq[ring->cq_head % SFS_RING_SIZE];
+        ring->cq_head++;
+        pthread_mutex_unlock(&ring->lock);
+        return 0;
+}
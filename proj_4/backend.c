@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* A disk backed by an image file. disk->data caches the blocks read so far and
+ * writes go straight through to the file. When readahead is on, a thread
+ * fills the cache with the blocks queued by sfs_readahead. */
+struct sfs_backend {
+        int fd;                         // image file
+        int readahead;                  // 1 to prefetch ahead of sequential reads
+        uint8_t cached[SFS_NUM_BLOCKS]; // 1 if disk->data holds the block, 2 while it is being prefetched
+        uint8_t queue[SFS_NUM_BLOCKS];  // blocks waiting to be prefetched
+        int queued;                     // number of blocks in queue
+        int stop;                       // tells the readahead thread to exit
+        pthread_mutex_t lock;           // protects the fields above and disk->data
+        pthread_cond_t wake;            // signals the readahead thread
+        pthread_cond_t filled;          // signals readers waiting on prefetched blocks
+        pthread_t thread;               // readahead thread
+};
+
+/* Wait out the simulated device latency before a read from the image file. */
+static void sfs_backend_delay(struct sfs_disk* disk)
+{
+        if(disk->device_latency_us > 0) {
+                struct timespec ts = { 0, disk->device_latency_us * 1000L };
+                nanosleep(&ts, NULL);
+        }
+}
+
+/* Read a block from the image file into the cache. Call with the lock held. */
+static void sfs_backend_fill(struct sfs_disk* disk, int block)
+{
+        struct sfs_backend* backend = disk->backend;
+        char* dst = &disk->data[block*SFS_BLOCK_SIZE];
+        sfs_backend_delay(disk);
+        int n = pread(backend->fd, dst, SFS_BLOCK_SIZE, (off_t)block*SFS_BLOCK_SIZE);
+        if(n < SFS_BLOCK_SIZE) {
+                memset(dst + (n > 0 ? n : 0), 0, SFS_BLOCK_SIZE - (n > 0 ? n : 0));
+        }
+        backend->cached[block] = 1;
+        disk->device_reads++;
+}
+
+static int sfs_compare_blocks(const void* a, const void* b)
+{
+        return *(const uint8_t*)a - *(const uint8_t*)b;
+}
+
+/* Prefetch queued blocks, reading each run of consecutive blocks with a single
+ * read from the image file. */
+static void* sfs_readahead_thread(void* arg)
+{
+        struct sfs_disk* disk = arg;
+        struct sfs_backend* backend = disk->backend;
+        uint8_t blocks[SFS_NUM_BLOCKS];
+        char buf[SFS_RA_MAX_BLOCKS * SFS_BLOCK_SIZE];
+        pthread_mutex_lock(&backend->lock);
+        while(!backend->stop) {
+                if(backend->queued == 0) {
+                        pthread_cond_wait(&backend->wake, &backend->lock);
+                        continue;
+                }
+                int n = backend->queued;
+                memcpy(blocks, backend->queue, n);
+                backend->queued = 0;
+                pthread_mutex_unlock(&backend->lock);
+                qsort(blocks, n, 1, sfs_compare_blocks);
+                for(int i=0; i < n; ) {
+                        int j = i + 1;
+                        while(j < n && j - i < SFS_RA_MAX_BLOCKS && blocks[j] == blocks[j-1] + 1) j++;
+                        sfs_backend_delay(disk);
+                        int len = pread(backend->fd, buf, (j - i)*SFS_BLOCK_SIZE, (off_t)blocks[i]*SFS_BLOCK_SIZE);
+                        pthread_mutex_lock(&backend->lock);
+                        disk->device_reads++;
+                        for(int k=i; k < j; k++) {
+                                if((k - i + 1)*SFS_BLOCK_SIZE <= len) {
+                                        memcpy(&disk->data[blocks[k]*SFS_BLOCK_SIZE], buf + (k - i)*SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+                                        backend->cached[blocks[k]] = 1;
+                                }
+                                else {
+                                        backend->cached[blocks[k]] = 0; // short read, readers fetch it themselves
+                                }
+                        }
+                        pthread_cond_broadcast(&backend->filled);
+                        pthread_mutex_unlock(&backend->lock);
+                        i = j;
+                }
+                pthread_mutex_lock(&backend->lock);
+        }
+        pthread_mutex_unlock(&backend->lock);
+        return NULL;
+}
+
+/* Use the image file at `path` as the disk, creating it if needed. Nothing is
+ * read until it is used, so mount the disk after opening it. Set readahead=1
+ * to prefetch blocks ahead of sequential reads. Returns 0, or -1 on failure. */
+int sfs_backend_open(struct sfs_disk* disk, char* path, int readahead)
+{
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if(fd < 0 || ftruncate(fd, SFS_NUM_BLOCKS*SFS_BLOCK_SIZE) != 0) {
+                printf("ERROR: can't open disk image %s\n", path);
+                if(fd >= 0) close(fd);
+                return -1;
+        }
+        struct sfs_backend* backend = calloc(1, sizeof(struct sfs_backend));
+        if(backend == NULL) {
+                printf("ERROR: can't allocate backend for %s\n", path);
+                close(fd);
+                return -1;
+        }
+        backend->fd = fd;
+        backend->readahead = readahead;
+        pthread_mutex_init(&backend->lock, NULL);
+        pthread_cond_init(&backend->wake, NULL);
+        pthread_cond_init(&backend->filled, NULL);
+        disk->backend = backend;
+        disk->device_reads = 0;
+        memset(disk->dirty, 0xff, sizeof(disk->dirty)); // the image may differ from the last dump
+        memset(disk->csum_ok, 0, sizeof(disk->csum_ok)); // blocks read from the image are verified again
+        if(readahead && pthread_create(&backend->thread, NULL, sfs_readahead_thread, disk) != 0) {
+                printf("ERROR: can't start readahead thread, continuing without it\n");
+                backend->readahead = 0;
+        }
+        return 0;
+}
+
+/* Stop using the image file. Blocks that were never read are read in first so
+ * the disk keeps working from memory. */
+void sfs_backend_close(struct sfs_disk* disk)
+{
+        struct sfs_backend* backend = disk->backend;
+        if(backend == NULL) return;
+        sfs_lazy_init_stop(disk);
+        sfs_csum_flush(disk);
+        if(backend->readahead) {
+                pthread_mutex_lock(&backend->lock);
+                backend->stop = 1;
+                pthread_cond_signal(&backend->wake);
+                pthread_mutex_unlock(&backend->lock);
+                pthread_join(backend->thread, NULL);
+        }
+        for(int block=0; block < SFS_NUM_BLOCKS; block++) {
+                if(backend->cached[block] != 1) sfs_backend_fill(disk, block);
+        }
+        close(backend->fd);
+        pthread_mutex_destroy(&backend->lock);
+        pthread_cond_destroy(&backend->wake);
+        pthread_cond_destroy(&backend->filled);
+        free(backend);
+        disk->backend = NULL;
+}
+
+/* disk_read for a disk with a backing file. */
+void sfs_backend_read(struct sfs_disk* disk, int block, int offset, void* dst, int num_bytes)
+{
+        struct sfs_backend* backend = disk->backend;
+        pthread_mutex_lock(&backend->lock);
+        while(backend->cached[block] == 2) pthread_cond_wait(&backend->filled, &backend->lock);
+        if(!backend->cached[block]) sfs_backend_fill(disk, block);
+        memcpy(dst, &disk->data[block*SFS_BLOCK_SIZE + offset], num_bytes);
+        pthread_mutex_unlock(&backend->lock);
+}
+
+/* disk_write for a disk with a backing file. */
+void sfs_backend_write(struct sfs_disk* disk, int block, int offset, void* src, int num_bytes)
+{
+        struct sfs_backend* backend = disk->backend;
+        pthread_mutex_lock(&backend->lock);
+        while(backend->cached[block] == 2) pthread_cond_wait(&backend->filled, &backend->lock);
+        if(!backend->cached[block]) {
+                if(num_bytes == SFS_BLOCK_SIZE) backend->cached[block] = 1;
+                else sfs_backend_fill(disk, block); // keep the rest of the block
+        }
+        memcpy(&disk->data[block*SFS_BLOCK_SIZE + offset], src, num_bytes);
+        if(pwrite(backend->fd, src, num_bytes, (off_t)block*SFS_BLOCK_SIZE + offset) != num_bytes) {
+                printf("ERROR: write to disk image failed on block %d\n", block);
+        }
+        pthread_mutex_unlock(&backend->lock);
+}
+
+/* Called by sfs_read before reading nbytes at the file's current offset. Reads
+ * that continue where the last one stopped are sequential: the first prefetches
+ * SFS_RA_MIN_BLOCKS blocks past the read, and once less than half a window is
+ * left prefetched the window doubles up to SFS_RA_MAX_BLOCKS. Any other read is
+ * random and stops readahead until reads are sequential again. */
+void sfs_readahead(struct sfs_disk* disk, struct sfs_open_file* file, int nbytes)
+{
+        struct sfs_backend* backend = disk->backend;
+        struct sfs_inode* inode = &file->inode;
+        if(!backend->readahead || nbytes <= 0) return;
+        int sequential = file->cur_offset == file->ra_next;
+        file->ra_next = file->cur_offset + nbytes;
+        if(!sequential) {
+                file->ra_window = 0;
+                file->ra_end = 0;
+                return;
+        }
+        int next = (file->cur_offset + nbytes - 1) / SFS_BLOCK_SIZE + 1; // first block after this read
+        if(file->ra_end < next) file->ra_end = next;
+        if(file->ra_window > 0 && file->ra_end - next >= file->ra_window / 2) return;
+        if(file->ra_window == 0) file->ra_window = SFS_RA_MIN_BLOCKS;
+        else if(file->ra_window < SFS_RA_MAX_BLOCKS) file->ra_window *= 2;
+        int end = file->ra_end + file->ra_window;
+        if(end > inode->used_blocks) end = inode->used_blocks;
+        if(end <= file->ra_end) return;
+        pthread_mutex_lock(&backend->lock);
+        for(int i=file->ra_end; i < end && backend->queued < SFS_NUM_BLOCKS; i++) {
+                if(backend->cached[inode->block[i]] != 0) continue;
+                backend->cached[inode->block[i]] = 2; // readers wait for the prefetch
+                backend->queue[backend->queued++] = inode->block[i];
+        }
+        pthread_cond_signal(&backend->wake);
+        pthread_mutex_unlock(&backend->lock);
+        file->ra_end = end;
+}
@@ -0,0 +1,589 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "sfs.h"
+#include "workload.h"
+
+#define BENCH_ROUNDS 2000       // times each workload is repeated
+#define BENCH_RECORD 64         // bytes per read or write call
+#define BENCH_FILE_SIZE 3200    // bytes per file, fits uncompressed as well
+
+/* Wall clock time in seconds. */
+double bench_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Seconds since `start`. */
+double bench_elapsed(double start)
+{
+        return bench_now() - start;
+}
+
+/* Print a throughput result in MB/s. */
+void bench_report(char* name, double bytes, double seconds)
+{
+        printf("  %-34s %9.2f MB/s\n", name, bytes / seconds / (1024 * 1024));
+}
+
+/* Size in bytes of the file at path, or -1 if it can't be opened. */
+long bench_file_size(char* path)
+{
+        FILE* f = fopen(path, "rb");
+        if(f == NULL) return -1;
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fclose(f);
+        return size;
+}
+
+/* Write BENCH_FILE_SIZE bytes of log data to a fresh file in records, then
+ * read it back sequentially and at random offsets. create_flag picks plain or
+ * compressed files. */
+void bench_compression(struct sfs_disk* disk, char* label, int create_flag)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE);
+        char record[BENCH_RECORD];
+        int fd = -1;
+        fill_log_lines(data, BENCH_FILE_SIZE);
+        printf("%s files:\n", label);
+
+        double start = bench_now();
+        for(int r=0; r < BENCH_ROUNDS; r++) {
+                sfs_format(disk);
+                sfs_mount(disk, NULL);
+                fd = sfs_open(disk, "log", create_flag);
+                for(int off=0; off < BENCH_FILE_SIZE; off += BENCH_RECORD) {
+                        sfs_write(disk, fd, data + off, BENCH_RECORD);
+                }
+                if(r < BENCH_ROUNDS - 1) sfs_close(disk, fd);
+        }
+        bench_report("write", (double)BENCH_ROUNDS * BENCH_FILE_SIZE, bench_elapsed(start));
+        int blocks = disk->open_list[fd].inode.used_blocks;
+        printf("  %-34s %9.2f (%d bytes in %d blocks)\n", "compression ratio",
+                (double)BENCH_FILE_SIZE / (blocks * SFS_BLOCK_SIZE), BENCH_FILE_SIZE, blocks);
+
+        start = bench_now();
+        for(int r=0; r < BENCH_ROUNDS; r++) {
+                sfs_seek(disk, fd, 0, SEEK_SET);
+                for(int off=0; off < BENCH_FILE_SIZE; off += BENCH_RECORD) {
+                        sfs_read(disk, fd, record, BENCH_RECORD);
+                }
+        }
+        bench_report("sequential read", (double)BENCH_ROUNDS * BENCH_FILE_SIZE, bench_elapsed(start));
+
+        srand(1);
+        start = bench_now();
+        for(int r=0; r < BENCH_ROUNDS * (BENCH_FILE_SIZE / BENCH_RECORD); r++) {
+                sfs_seek(disk, fd, rand() % (BENCH_FILE_SIZE - BENCH_RECORD), SEEK_SET);
+                sfs_read(disk, fd, record, BENCH_RECORD);
+        }
+        bench_report("random read", (double)BENCH_ROUNDS * BENCH_FILE_SIZE, bench_elapsed(start));
+        sfs_close(disk, fd);
+        free(data);
+}
+
+/* Write BENCH_DEDUP_FILES files of BENCH_FILE_SIZE bytes, either all the
+ * same data or all random data, and report the write throughput and how many
+ * logical blocks each physical block holds. */
+#define BENCH_DEDUP_FILES 8
+void bench_dedup(struct sfs_disk* disk, char* label, uint8_t flags, int unique)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE * BENCH_DEDUP_FILES);
+        char name[SFS_NAME_LENGTH];
+        srand(1);
+        for(int i=0; i < BENCH_FILE_SIZE * BENCH_DEDUP_FILES; i++) {
+                data[i] = unique ? rand() : 'a';
+        }
+        int rounds = BENCH_ROUNDS / BENCH_DEDUP_FILES;
+        double start = bench_now();
+        for(int r=0; r < rounds; r++) {
+                sfs_format_flags(disk, flags);
+                sfs_mount(disk, NULL);
+                for(int f=0; f < BENCH_DEDUP_FILES; f++) {
+                        snprintf(name, sizeof(name), "file%d", f);
+                        int fd = sfs_open(disk, name, SFS_CREATE);
+                        for(int off=0; off < BENCH_FILE_SIZE; off += BENCH_RECORD) {
+                                sfs_write(disk, fd, data + f * BENCH_FILE_SIZE + off, BENCH_RECORD);
+                        }
+                        sfs_close(disk, fd);
+                }
+        }
+        printf("%s:\n", label);
+        bench_report("write", (double)rounds * BENCH_DEDUP_FILES * BENCH_FILE_SIZE, bench_elapsed(start));
+        int logical = BENCH_DEDUP_FILES * ((BENCH_FILE_SIZE + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE);
+        int physical = disk->super.used_data - disk->root_dir_inode.used_blocks; // don't count the root directory
+        printf("  %-34s %9.2f (%d blocks in %d)\n", "dedup ratio",
+                (double)logical / physical, logical, physical);
+        free(data);
+}
+
+/* Scan a file on the file backend in small records, starting each round with
+ * an empty cache, with readahead on or off. latency_us simulates a slower
+ * device than the page cache. */
+#define BENCH_SMALL_RECORD 16
+void bench_readahead(struct sfs_disk* disk, char* label, int readahead, int latency_us)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE);
+        char record[BENCH_SMALL_RECORD];
+        double elapsed = 0;
+        int reads = 0;
+        int rounds = BENCH_ROUNDS / 10;
+        fill_log_lines(data, BENCH_FILE_SIZE);
+        sfs_backend_open(disk, "bench.img", 0);
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        int fd = sfs_open(disk, "log", SFS_CREATE);
+        sfs_write(disk, fd, data, BENCH_FILE_SIZE);
+        sfs_close(disk, fd);
+        sfs_backend_close(disk);
+        disk->device_latency_us = latency_us;
+        for(int r=0; r < rounds; r++) {
+                sfs_backend_open(disk, "bench.img", readahead);
+                sfs_mount(disk, NULL);
+                fd = sfs_open(disk, "log", 0);
+                int before = disk->device_reads;
+                double start = bench_now();
+                for(int off=0; off < BENCH_FILE_SIZE; off += BENCH_SMALL_RECORD) {
+                        sfs_read(disk, fd, record, BENCH_SMALL_RECORD);
+                }
+                elapsed += bench_elapsed(start);
+                reads += disk->device_reads - before;
+                sfs_close(disk, fd);
+                sfs_backend_close(disk);
+        }
+        disk->device_latency_us = 0;
+        printf("%s:\n", label);
+        bench_report("sequential 16 byte reads", (double)rounds * BENCH_FILE_SIZE, elapsed);
+        printf("  %-34s %9.2f\n", "device reads per scan", (double)reads / rounds);
+        unlink("bench.img");
+        free(data);
+}
+
+/* Write BENCH_WRITERS files at once on the file backend, one record to each in
+ * turn, then report the extents per file and how fast the files can be read
+ * back sequentially with readahead from a device with 100us reads. */
+#define BENCH_WRITERS 8
+void bench_fragmentation(struct sfs_disk* disk, char* label, uint8_t flags)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE);
+        char record[BENCH_SMALL_RECORD];
+        char name[SFS_NAME_LENGTH];
+        int fd[BENCH_WRITERS];
+        int size = 3000; // 8 files of 24 blocks fit on the disk
+        int extents = 0;
+        int rounds = 10;
+        fill_log_lines(data, BENCH_FILE_SIZE);
+        sfs_backend_open(disk, "bench.img", 0);
+        sfs_format_flags(disk, flags);
+        sfs_mount(disk, NULL);
+        for(int f=0; f < BENCH_WRITERS; f++) {
+                snprintf(name, sizeof(name), "writer%d", f);
+                fd[f] = sfs_open(disk, name, SFS_CREATE);
+        }
+        for(int off=0; off < size; off += BENCH_RECORD) {
+                int len = size - off < BENCH_RECORD ? size - off : BENCH_RECORD;
+                for(int f=0; f < BENCH_WRITERS; f++) sfs_write(disk, fd[f], data + off, len);
+        }
+        for(int f=0; f < BENCH_WRITERS; f++) {
+                sfs_close(disk, fd[f]);
+                snprintf(name, sizeof(name), "writer%d", f);
+                fd[f] = sfs_open(disk, name, 0);
+                extents += sfs_count_extents(&disk->open_list[fd[f]].inode);
+                sfs_close(disk, fd[f]);
+        }
+        sfs_backend_close(disk);
+
+        double elapsed = 0;
+        disk->device_latency_us = 100;
+        for(int r=0; r < rounds; r++) {
+                sfs_backend_open(disk, "bench.img", 1);
+                sfs_mount(disk, NULL);
+                double start = bench_now();
+                for(int f=0; f < BENCH_WRITERS; f++) {
+                        snprintf(name, sizeof(name), "writer%d", f);
+                        fd[f] = sfs_open(disk, name, 0);
+                        for(int off=0; off < size; off += BENCH_SMALL_RECORD) {
+                                sfs_read(disk, fd[f], record, BENCH_SMALL_RECORD);
+                        }
+                        sfs_close(disk, fd[f]);
+                }
+                elapsed += bench_elapsed(start);
+                sfs_backend_close(disk);
+        }
+        disk->device_latency_us = 0;
+        printf("%s:\n", label);
+        printf("  %-34s %9.2f\n", "extents per file", (double)extents / BENCH_WRITERS);
+        bench_report("sequential read (100us reads)", (double)rounds * BENCH_WRITERS * size, elapsed);
+        unlink("bench.img");
+        free(data);
+}
+
+/* Sort helper for latency samples. */
+static int bench_compare_doubles(const void* a, const void* b)
+{
+        double x = *(const double*)a, y = *(const double*)b;
+        return (x > y) - (x < y);
+}
+
+/* Print request throughput and the median and 99th percentile latency of the
+ * `n` samples in `latency`, which get sorted. */
+void bench_report_requests(double* latency, int n, double seconds)
+{
+        qsort(latency, n, sizeof(double), bench_compare_doubles);
+        printf("  %-34s %9.0f req/s\n", "throughput", n / seconds);
+        printf("  %-34s %9.2f us\n", "p50 latency", latency[n / 2] * 1e6);
+        printf("  %-34s %9.2f us\n", "p99 latency", latency[n * 99 / 100] * 1e6);
+}
+
+#define BENCH_ASYNC_REQUESTS 20480      // reads issued per design, a multiple of the wave
+#define BENCH_ASYNC_WAVE 64             // reads in flight at once
+#define BENCH_ASYNC_FILES 4
+#define BENCH_ASYNC_WORKERS 4
+
+/* One read issued by the thread-per-request design. */
+struct bench_request {
+        struct sfs_disk* disk;
+        int fd;
+        int offset;
+        char buf[BENCH_RECORD];
+        double done;
+};
+
+static pthread_mutex_t bench_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* bench_request_thread(void* arg)
+{
+        struct bench_request* req = arg;
+        pthread_mutex_lock(&bench_fs_lock); // the sync API isn't thread safe either
+        sfs_seek(req->disk, req->fd, req->offset, SEEK_SET);
+        sfs_read(req->disk, req->fd, req->buf, BENCH_RECORD);
+        pthread_mutex_unlock(&bench_fs_lock);
+        req->done = bench_now();
+        return NULL;
+}
+
+/* Issue BENCH_RECORD byte reads at random offsets in waves of
+ * BENCH_ASYNC_WAVE, first with a thread started per read on the sync API and
+ * then through an async ring with BENCH_ASYNC_WORKERS workers. Latency is
+ * measured from issuing a read to seeing its result. */
+void bench_async(struct sfs_disk* disk)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE);
+        char name[SFS_NAME_LENGTH];
+        int fd[BENCH_ASYNC_FILES];
+        double* latency = (double*) malloc(BENCH_ASYNC_REQUESTS * sizeof(double));
+        struct bench_request req[BENCH_ASYNC_WAVE];
+        pthread_t thread[BENCH_ASYNC_WAVE];
+        char buf[BENCH_ASYNC_WAVE][BENCH_RECORD];
+        double issued[BENCH_ASYNC_WAVE];
+        fill_log_lines(data, BENCH_FILE_SIZE);
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        for(int f=0; f < BENCH_ASYNC_FILES; f++) {
+                snprintf(name, sizeof(name), "async%d", f);
+                fd[f] = sfs_open(disk, name, SFS_CREATE);
+                sfs_write(disk, fd[f], data, BENCH_FILE_SIZE);
+        }
+
+        srand(1);
+        double start = bench_now();
+        for(int done=0; done < BENCH_ASYNC_REQUESTS; done += BENCH_ASYNC_WAVE) {
+                for(int i=0; i < BENCH_ASYNC_WAVE; i++) {
+                        req[i].disk = disk;
+                        req[i].fd = fd[rand() % BENCH_ASYNC_FILES];
+                        req[i].offset = rand() % (BENCH_FILE_SIZE - BENCH_RECORD);
+                        issued[i] = bench_now();
+                        pthread_create(&thread[i], NULL, bench_request_thread, &req[i]);
+                }
+                for(int i=0; i < BENCH_ASYNC_WAVE; i++) {
+                        pthread_join(thread[i], NULL);
+                        latency[done + i] = req[i].done - issued[i];
+                }
+        }
+        printf("Thread per request, sync API:\n");
+        bench_report_requests(latency, BENCH_ASYNC_REQUESTS, bench_elapsed(start));
+
+        srand(1);
+        struct sfs_ring* ring = sfs_ring_init(disk, BENCH_ASYNC_WORKERS);
+        struct sfs_cqe cqe;
+        start = bench_now();
+        for(int done=0; done < BENCH_ASYNC_REQUESTS; done += BENCH_ASYNC_WAVE) {
+                for(int i=0; i < BENCH_ASYNC_WAVE; i++) {
+                        struct sfs_sqe* sqe = sfs_ring_get_sqe(ring);
+                        sqe->op = SFS_OP_READ;
+                        sqe->filedes = fd[rand() % BENCH_ASYNC_FILES];
+                        sqe->offset = rand() % (BENCH_FILE_SIZE - BENCH_RECORD);
+                        sqe->buf = buf[i];
+                        sqe->nbytes = BENCH_RECORD;
+                        sqe->user_data = i;
+                        issued[i] = bench_now();
+                }
+                sfs_ring_submit(ring);
+                while(sfs_ring_wait_cqe(ring, &cqe) == 0) {
+                        latency[done + cqe.user_data] = bench_now() - issued[cqe.user_data];
+                }
+        }
+        printf("Async ring, %d workers:\n", BENCH_ASYNC_WORKERS);
+        bench_report_requests(latency, BENCH_ASYNC_REQUESTS, bench_elapsed(start));
+        sfs_ring_exit(ring);
+
+        for(int f=0; f < BENCH_ASYNC_FILES; f++) sfs_close(disk, fd[f]);
+        free(latency);
+        free(data);
+}
+
+/* Fill the disk with files, then take BENCH_CHECKPOINTS checkpoints, changing
+ * about 1% of the disk between them. Compare full dumps with a full dump
+ * followed by deltas, and restoring from a full dump with restoring a base plus
+ * the chain of deltas. */
+#define BENCH_CHECKPOINTS 50    // checkpoints per round, within SFS_MAX_DUMP_CHAIN
+#define BENCH_DUMP_FILES 8
+void bench_dump(struct sfs_disk* disk)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE);
+        char name[SFS_DUMP_NAME_LENGTH];
+        int rounds = 10;
+        int size = 3000; // 8 files of 24 blocks fill most of the disk
+        double elapsed[2] = { 0, 0 };
+        long bytes[2] = { 0, 0 };
+        fill_log_lines(data, BENCH_FILE_SIZE);
+        srand(1);
+        for(int delta=0; delta < 2; delta++) {
+                for(int r=0; r < rounds; r++) {
+                        sfs_format(disk);
+                        sfs_mount(disk, NULL);
+                        for(int f=0; f < BENCH_DUMP_FILES; f++) {
+                                snprintf(name, sizeof(name), "file%d", f);
+                                int fd = sfs_open(disk, name, SFS_CREATE);
+                                sfs_write(disk, fd, data, size);
+                                sfs_close(disk, fd);
+                        }
+                        sfs_dump(disk, "bench.dump0");
+                        for(int c=1; c <= BENCH_CHECKPOINTS; c++) {
+                                // rewrite two blocks of a file, which also writes its inode block
+                                snprintf(name, sizeof(name), "file%d", rand() % BENCH_DUMP_FILES);
+                                int fd = sfs_open(disk, name, 0);
+                                sfs_seek(disk, fd, (rand() % (size / SFS_BLOCK_SIZE - 1)) * SFS_BLOCK_SIZE, SEEK_SET);
+                                sfs_write(disk, fd, data + rand() % SFS_BLOCK_SIZE, 2 * SFS_BLOCK_SIZE);
+                                sfs_close(disk, fd);
+                                // full dumps replace a single file, deltas each get their own
+                                snprintf(name, sizeof(name), "bench.dump%d", delta ? c : 0);
+                                double start = bench_now();
+                                sfs_dump(disk, name);
+                                elapsed[delta] += bench_elapsed(start);
+                                bytes[delta] += bench_file_size(name);
+                        }
+                }
+                printf("%s:\n", delta ? "Incremental dumps" : "Full dumps");
+                printf("  %-34s %9.0f /s\n", "checkpoints", rounds * BENCH_CHECKPOINTS / elapsed[delta]);
+                printf("  %-34s %9.0f\n", "bytes per checkpoint", (double)bytes[delta] / (rounds * BENCH_CHECKPOINTS));
+                double start = bench_now();
+                for(int r=0; r < rounds; r++) {
+                        snprintf(name, sizeof(name), "bench.dump%d", delta ? BENCH_CHECKPOINTS : 0);
+                        sfs_mount(disk, name);
+                }
+                printf("  %-34s %9.2f ms\n", delta ? "restore (base + all deltas)" : "restore", bench_elapsed(start) / rounds * 1e3);
+        }
+        for(int c=0; c <= BENCH_CHECKPOINTS; c++) {
+                snprintf(name, sizeof(name), "bench.dump%d", c);
+                unlink(name);
+        }
+        free(data);
+}
+
+/* Fill the root directory with as many files as there are free inodes, then
+ * list it repeatedly, once reading each entry and its inode separately as
+ * sfs_ls_dir used to, and once in sfs_readdir batches. */
+void bench_readdir(struct sfs_disk* disk)
+{
+        char name[SFS_NAME_LENGTH];
+        struct sfs_dirent entries[SFS_READDIR_BATCH];
+        struct sfs_dir_entry dir;
+        struct sfs_inode inode;
+        int rounds = BENCH_ROUNDS * 50;
+        int files = SFS_INODE_BLOCKS * SFS_BLOCK_SIZE / SFS_INODE_SIZE - 1;
+        long found = 0;
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        for(int f=0; f < files; f++) {
+                snprintf(name, sizeof(name), "file%d", f);
+                sfs_close(disk, sfs_open(disk, name, SFS_CREATE));
+        }
+        struct sfs_inode* root = &disk->root_dir_inode;
+        int max_entries = root->used_blocks * SFS_BLOCK_SIZE / SFS_DIR_ENTRY_SIZE;
+        long reads = disk->disk_reads;
+        double start = bench_now();
+        for(int r=0; r < rounds; r++) {
+                for(int n=0; n < max_entries; n++) {
+                        if(sfs_read_dir_entry(disk, root, n, &dir) != 0) continue;
+                        sfs_read_inode(disk, dir.inum, &inode);
+                        found += inode.type != 0;
+                }
+        }
+        double elapsed = bench_elapsed(start);
+        printf("Directory of %d entries, one inode read per entry:\n", files + 1);
+        printf("  %-34s %9.0f /s\n", "entries listed", found / elapsed);
+        printf("  %-34s %9.2f\n", "disk reads per listing", (double)(disk->disk_reads - reads) / rounds);
+        found = 0;
+        reads = disk->disk_reads;
+        start = bench_now();
+        for(int r=0; r < rounds; r++) {
+                int cursor = 0, n;
+                while((n = sfs_readdir(disk, root, &cursor, entries, SFS_READDIR_BATCH)) > 0) {
+                        for(int i=0; i < n; i++) found += entries[i].inode.type != 0;
+                }
+        }
+        elapsed = bench_elapsed(start);
+        printf("Directory of %d entries, sfs_readdir:\n", files + 1);
+        printf("  %-34s %9.0f /s\n", "entries listed", found / elapsed);
+        printf("  %-34s %9.2f\n", "disk reads per listing", (double)(disk->disk_reads - reads) / rounds);
+}
+
+/* Write a BENCH_FILE_SIZE byte file in records to a disk formatted with
+ * `flags` and read it back sequentially, remounting first so every block read
+ * is verified again when checksums are on. Formatting and mounting aren't
+ * timed. */
+void bench_checksum(struct sfs_disk* disk, char* label, uint8_t flags)
+{
+        char* data = (char*) malloc(BENCH_FILE_SIZE);
+        char record[BENCH_RECORD];
+        double write_time = 0, read_time = 0;
+        fill_log_lines(data, BENCH_FILE_SIZE);
+        for(int r=0; r < BENCH_ROUNDS; r++) {
+                sfs_format_flags(disk, flags);
+                sfs_mount(disk, NULL);
+                double start = bench_now();
+                int fd = sfs_open(disk, "log", SFS_CREATE);
+                for(int off=0; off < BENCH_FILE_SIZE; off += BENCH_RECORD) {
+                        sfs_write(disk, fd, data + off, BENCH_RECORD);
+                }
+                sfs_close(disk, fd);
+                write_time += bench_elapsed(start);
+
+                sfs_mount(disk, NULL);
+                start = bench_now();
+                fd = sfs_open(disk, "log", 0);
+                for(int off=0; off < BENCH_FILE_SIZE; off += BENCH_RECORD) {
+                        sfs_read(disk, fd, record, BENCH_RECORD);
+                }
+                sfs_close(disk, fd);
+                read_time += bench_elapsed(start);
+        }
+        printf("%s:\n", label);
+        bench_report("write", (double)BENCH_ROUNDS * BENCH_FILE_SIZE, write_time);
+        bench_report("sequential read after mount", (double)BENCH_ROUNDS * BENCH_FILE_SIZE, read_time);
+        free(data);
+}
+
+/* Raw CRC32C throughput over one block, with the implementation picked for
+ * this CPU. Run with SFS_NO_SSE42=1 to measure the table fallback. */
+void bench_crc32c(void)
+{
+        char block[SFS_BLOCK_SIZE];
+        uint32_t sum = 0;
+        int rounds = BENCH_ROUNDS * 1000;
+        fill_log_lines(block, SFS_BLOCK_SIZE);
+        double start = bench_now();
+        for(int r=0; r < rounds; r++) {
+                block[0] = r;
+                sum += sfs_crc32c(block, SFS_BLOCK_SIZE);
+        }
+        printf("CRC32C (%s):\n", getenv("SFS_NO_SSE42") ? "table" : "SSE4.2 if available");
+        bench_report("checksum", (double)rounds * SFS_BLOCK_SIZE, bench_elapsed(start));
+        if(sum == 1) printf("\n"); // keep the loop from being optimized out
+}
+
+/* Blocks written since the dirty bitmap was last cleared. */
+int bench_dirty_blocks(struct sfs_disk* disk)
+{
+        int n = 0;
+        for(int block=0; block < SFS_NUM_BLOCKS; block++) {
+                n += (disk->dirty[block / 8] >> (block % 8)) & 1;
+        }
+        return n;
+}
+
+/* Format and mount a disk, either leaving the metadata blocks for lazy
+ * initialization or waiting for the background initializer to zero all of
+ * them, which is what format used to do up front. */
+void bench_format(struct sfs_disk* disk, char* label, int wait)
+{
+        int rounds = BENCH_ROUNDS * 10;
+        int written = 0;
+        double start = bench_now();
+        for(int r=0; r < rounds; r++) {
+                memset(disk->dirty, 0, sizeof(disk->dirty));
+                sfs_format(disk);
+                if(wait) {
+                        sfs_lazy_init_start(disk);
+                        sfs_lazy_init_wait(disk);
+                }
+                written += bench_dirty_blocks(disk);
+                sfs_mount(disk, NULL);
+        }
+        double elapsed = bench_elapsed(start);
+        printf("%s:\n", label);
+        printf("  %-34s %9.2f us\n", "format and mount", elapsed * 1e6 / rounds);
+        printf("  %-34s %9.2f\n", "blocks written by format", (double)written / rounds);
+}
+
+int main(void)
+{
+        struct sfs_disk disk;
+        memset(&disk, 0, sizeof(disk));
+        disk.data = (char *) malloc(SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        if(disk.data == NULL) {
+                printf("Error allocating disk memory!\n");
+                return -1;
+        }
+
+        // compressed vs uncompressed log files
+        bench_compression(&disk, "Uncompressed", SFS_CREATE);
+        bench_compression(&disk, "Compressed", SFS_CREATE_COMPRESSED);
+
+        // dedup on duplicate heavy and unique data
+        bench_dedup(&disk, "Duplicate data, no dedup", 0, 0);
+        bench_dedup(&disk, "Duplicate data, dedup", SFS_FLAG_DEDUP, 0);
+        bench_dedup(&disk, "Unique data, no dedup", 0, 1);
+        bench_dedup(&disk, "Unique data, dedup", SFS_FLAG_DEDUP, 1);
+
+        // small sequential reads from an image file
+        bench_readahead(&disk, "File backend, no readahead", 0, 0);
+        bench_readahead(&disk, "File backend, readahead", 1, 0);
+        bench_readahead(&disk, "File backend (100us reads), no readahead", 0, 100);
+        bench_readahead(&disk, "File backend (100us reads), readahead", 1, 100);
+
+        // fragmentation from interleaved writers
+        bench_fragmentation(&disk, "8 writers, allocate on write", 0);
+        bench_fragmentation(&disk, "8 writers, delayed allocation", SFS_FLAG_DELALLOC);
+
+        // thread per request vs the async ring
+        bench_async(&disk);
+
+        // full vs incremental checkpoints with 1% of the disk changing between them
+        bench_dump(&disk);
+
+        // per entry inode reads vs batched readdir
+        bench_readdir(&disk);
+
+        // checksum overhead on reads and writes
+        bench_crc32c();
+        bench_checksum(&disk, "No checksums", 0);
+        bench_checksum(&disk, "Metadata checksums", SFS_FLAG_CHECKSUM);
+        bench_checksum(&disk, "Metadata and data checksums", SFS_FLAG_CHECKSUM_DATA);
+
+        // lazy vs fully initialized format
+        bench_format(&disk, "Lazy format", 0);
+        bench_format(&disk, "Format, background init to completion", 1);
+
+        return 0;
+}
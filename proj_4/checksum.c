@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define SFS_HAVE_SSE42_CRC
+#endif
+
+#define SFS_CRC32C_POLY 0x82F63B78 // CRC32C (Castagnoli) polynomial, bit reversed
+
+static uint32_t sfs_crc32c_table[256];
+
+/* Table driven CRC32C, one byte at a time. */
+static uint32_t sfs_crc32c_sw(uint32_t crc, const char* data, int len)
+{
+        for(int i=0; i < len; i++) {
+                crc = sfs_crc32c_table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+}
+
+#ifdef SFS_HAVE_SSE42_CRC
+/* CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time. Only
+ * called once the CPU is known to support it. */
+__attribute__((target("sse4.2")))
+static uint32_t sfs_crc32c_sse42(uint32_t crc, const char* data, int len)
+{
+        uint64_t crc64 = crc;
+        int i = 0;
+        for(; i + 8 <= len; i += 8) {
+                uint64_t word;
+                memcpy(&word, data + i, 8);
+                crc64 = _mm_crc32_u64(crc64, word);
+        }
+        crc = (uint32_t)crc64;
+        for(; i < len; i++) {
+                crc = _mm_crc32_u8(crc, data[i]);
+        }
+        return crc;
+}
+#endif
+
+static uint32_t (*sfs_crc32c_impl)(uint32_t crc, const char* data, int len);
+
+/* Pick the CRC32C implementation for this CPU and build the fallback table. */
+static void sfs_crc32c_init(void)
+{
+        for(uint32_t i=0; i < 256; i++) {
+                uint32_t crc = i;
+                for(int j=0; j < 8; j++) {
+                        crc = (crc >> 1) ^ (crc & 1 ? SFS_CRC32C_POLY : 0);
+                }
+                sfs_crc32c_table[i] = crc;
+        }
+        sfs_crc32c_impl = sfs_crc32c_sw;
+#ifdef SFS_HAVE_SSE42_CRC
+        if(getenv("SFS_NO_SSE42") == NULL && __builtin_cpu_supports("sse4.2")) {
+                sfs_crc32c_impl = sfs_crc32c_sse42;
+        }
+#endif
+}
+
+/* CRC32C of len bytes of data. Uses the SSE4.2 crc32 instruction when the CPU
+ * has it (unless SFS_NO_SSE42 is set in the environment) and a lookup table
+ * otherwise. */
+uint32_t sfs_crc32c(const void* data, int len)
+{
+        if(sfs_crc32c_impl == NULL) sfs_crc32c_init();
+        return ~sfs_crc32c_impl(0xffffffff, data, len);
+}
+
+/* Is block covered by a checksum? The checksum region itself isn't; data
+ * blocks are only covered with SFS_FLAG_CHECKSUM_DATA. */
+static int sfs_csum_covers(struct sfs_disk* disk, int block)
+{
+        int start = disk->super.csum_start;
+        if(start == 0) return 0;
+        if(block >= start && block < start + SFS_CSUM_BLOCKS) return 0;
+        return block < SFS_DATA_BLOCK_START || (disk->super.flags & SFS_FLAG_CHECKSUM_DATA);
+}
+
+/* Checksum of a block's current contents. 0 marks a block with no checksum
+ * yet, so a CRC of 0 is stored as 1. */
+static uint32_t sfs_csum_block(struct sfs_disk* disk, int block)
+{
+        uint32_t crc = sfs_crc32c(&disk->data[block*SFS_BLOCK_SIZE], SFS_BLOCK_SIZE);
+        return crc == 0 ? 1 : crc;
+}
+
+/* Store the checksum of a block's current contents if it is covered. */
+void sfs_csum_store(struct sfs_disk* disk, int block)
+{
+        if(!sfs_csum_covers(disk, block)) return;
+        uint32_t crc = sfs_csum_block(disk, block);
+        int slot = block * SFS_CSUM_SIZE;
+        disk_write(disk, disk->super.csum_start + slot / SFS_BLOCK_SIZE, slot % SFS_BLOCK_SIZE, &crc, SFS_CSUM_SIZE);
+}
+
+/* Store the checksum of every covered block written since the last flush.
+ * disk_write only marks blocks as stale, so a block written many times
+ * between flushes is only checksummed once. Called when files are closed,
+ * and before the disk is formatted, mounted, dumped or detached from its
+ * image file. Disks with an image file store checksums as blocks are written,
+ * so they have nothing stale. */
+void sfs_csum_flush(struct sfs_disk* disk)
+{
+        if(disk->super.csum_start == 0) return;
+        for(int i=0; i < SFS_NUM_BLOCKS / 8; i++) {
+                uint8_t stale = disk->csum_stale[i];
+                disk->csum_stale[i] = 0;
+                for(int block = i * 8; stale != 0; block++, stale >>= 1) {
+                        if(stale & 1) sfs_csum_store(disk, block);
+                }
+        }
+        memset(disk->csum_stale, 0, sizeof(disk->csum_stale)); // drop the checksum region's own bits
+}
+
+/* Called by disk_read the first time a block is read after mounting to check
+ * it against its stored checksum. Blocks that were never given a checksum
+ * pass. Returns 0, or -1 if the block is corrupt. */
+int sfs_csum_verify(struct sfs_disk* disk, int block)
+{
+        uint32_t stored;
+        if(sfs_csum_covers(disk, block)) {
+                int slot = block * SFS_CSUM_SIZE;
+                disk_read(disk, disk->super.csum_start + slot / SFS_BLOCK_SIZE, slot % SFS_BLOCK_SIZE, &stored, SFS_CSUM_SIZE);
+                if(stored != 0 && stored != sfs_csum_block(disk, block)) {
+                        printf("ERROR: checksum mismatch in block %d\n", block);
+                        return -1;
+                }
+        }
+        disk->csum_ok[block / 8] |= 1 << (block % 8);
+        return 0;
+}
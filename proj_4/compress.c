@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "disk.h"
+#include "sfs.h"
+#include "lz4.h"
+
+/* Number of blocks used to store an extent with compressed length `clen`. */
+static int sfs_extent_blocks(int clen)
+{
+        return (clen + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+}
+
+/* Return the index in inode->block of the first block of extent `n`. Extents
+ * are stored back to back after the map block. */
+static int sfs_extent_slot(uint16_t* map, int n)
+{
+        int slot = 1;
+        for(int i=0; i < n; i++) {
+                slot += sfs_extent_blocks(map[i]);
+        }
+        return slot;
+}
+
+/* Load the extent map of a compressed file into file->ext_map unless it is
+ * already there. Returns 0, or -1 if the map block failed its checksum. */
+static int sfs_load_extent_map(struct sfs_disk* disk, struct sfs_open_file* file)
+{
+        struct sfs_inode* inode = &file->inode;
+        if(file->map_loaded) return 0;
+        if(inode->used_blocks == 0) {
+                memset(file->ext_map, 0, sizeof(file->ext_map));
+        }
+        else if(disk_read(disk, inode->block[0], 0, file->ext_map, sizeof(file->ext_map)) != 0) {
+                return -1;
+        }
+        file->map_loaded = 1;
+        return 0;
+}
+
+/* Decompress extent `n` into file->ext_buf, zero filling the rest of the
+ * buffer. The last extent stays cached, so small sequential reads and writes
+ * only decompress each extent once.
+ * Returns the length of the extent (0 for a hole), or -1 if it is corrupt. */
+static int sfs_load_extent(struct sfs_disk* disk, struct sfs_open_file* file, int n)
+{
+        char cbuf[SFS_EXTENT_SIZE];
+        struct sfs_inode* inode = &file->inode;
+        uint16_t* map = file->ext_map;
+        char* ebuf = file->ext_buf;
+        if(file->ext_index == n) return file->ext_len;
+        int clen = map[n];
+        int slot = sfs_extent_slot(map, n);
+        int elen = 0;
+        file->ext_index = -1;
+        memset(ebuf, 0, SFS_EXTENT_SIZE);
+        for(int i=0; i < sfs_extent_blocks(clen); i++) {
+                int len = clen - i * SFS_BLOCK_SIZE;
+                if(len > SFS_BLOCK_SIZE) len = SFS_BLOCK_SIZE;
+                if(disk_read(disk, inode->block[slot + i], 0, cbuf + i * SFS_BLOCK_SIZE, len) != 0) return -1;
+        }
+        if(clen == SFS_EXTENT_SIZE) { // didn't compress, stored raw
+                memcpy(ebuf, cbuf, SFS_EXTENT_SIZE);
+                elen = SFS_EXTENT_SIZE;
+        }
+        else if(clen != 0) {
+                elen = lz4_decompress(cbuf, clen, ebuf, SFS_EXTENT_SIZE);
+                if(elen < 0) return -1;
+        }
+        file->ext_index = n;
+        file->ext_len = elen;
+        return elen;
+}
+
+/* Replace extent `n` with `clen` bytes of compressed data. Blocks of the old
+ * extent that only this file uses are overwritten in place; blocks shared with
+ * a clone or snapshot are never changed, so the extent gets fresh blocks in
+ * their place. The blocks of later extents shift along in inode->block.
+ * Returns 0, or -1 if there isn't enough space. */
+static int sfs_store_extent(struct sfs_disk* disk, struct sfs_inode* inode,
+        uint16_t* map, int n, char* cbuf, int clen)
+{
+        uint8_t blocks[SFS_EXTENT_SIZE / SFS_BLOCK_SIZE];
+        uint8_t kept[SFS_EXTENT_SIZE / SFS_BLOCK_SIZE]; // 1 if blocks[i] is the old extent's block i
+        int slot = sfs_extent_slot(map, n);
+        int old_blocks = sfs_extent_blocks(map[n]);
+        int new_blocks = sfs_extent_blocks(clen);
+        if(inode->used_blocks - old_blocks + new_blocks > SFS_BLOCKS_PER_INODE) {
+                printf("ERROR: compressed file has no room for another data block!\n");
+                return -1;
+        }
+        // get every block first, so a full disk leaves the old extent intact
+        for(int i=0; i < new_blocks; i++) {
+                kept[i] = i < old_blocks && sfs_get_ref(disk, inode->block[slot + i]) == 1;
+                blocks[i] = kept[i] ? inode->block[slot + i] : sfs_get_free_block(disk);
+                if(blocks[i] == 0) {
+                        while(--i >= 0) {
+                                if(!kept[i]) sfs_unref_block(disk, blocks[i]);
+                        }
+                        return -1;
+                }
+        }
+        for(int i=0; i < new_blocks; i++) {
+                int len = clen - i * SFS_BLOCK_SIZE;
+                if(len > SFS_BLOCK_SIZE) len = SFS_BLOCK_SIZE;
+                disk_write(disk, blocks[i], 0, cbuf + i * SFS_BLOCK_SIZE, len);
+        }
+        for(int i=0; i < old_blocks; i++) {
+                if(i >= new_blocks || !kept[i]) sfs_unref_block(disk, inode->block[slot + i]);
+        }
+        memmove(&inode->block[slot + new_blocks], &inode->block[slot + old_blocks],
+                inode->used_blocks - slot - old_blocks);
+        memcpy(&inode->block[slot], blocks, new_blocks);
+        inode->used_blocks += new_blocks - old_blocks;
+        map[n] = clen;
+        return 0;
+}
+
+/* Write nbytes of buf to a compressed file at its current offset. Each extent
+ * touched is decompressed, updated, and compressed again.
+ * Return -1 on failure or the number of bytes successfully written. */
+int sfs_write_compressed(struct sfs_disk* disk, struct sfs_open_file* file, void* buf, int nbytes)
+{
+        struct sfs_inode* inode = &file->inode;
+        char cbuf[SFS_EXTENT_SIZE];
+        if(file->cur_offset + nbytes > SFS_MAX_EXTENTS * SFS_EXTENT_SIZE) {
+                printf("ERROR: write is larger than the maximum file size!\n");
+                nbytes = SFS_MAX_EXTENTS * SFS_EXTENT_SIZE - file->cur_offset;
+        }
+        if(inode->used_blocks == 0) { // first write, so set up an empty map block
+                uint8_t block = sfs_get_free_block(disk);
+                if(block == 0) return -1;
+                memset(file->ext_map, 0, sizeof(file->ext_map));
+                disk_write(disk, block, 0, file->ext_map, sizeof(file->ext_map));
+                inode->block[0] = block;
+                inode->used_blocks = 1;
+                file->map_loaded = 1;
+        }
+        else if(sfs_cow_block(disk, inode, 0) == 0) { // the map may be shared
+                return -1;
+        }
+        if(sfs_load_extent_map(disk, file) != 0) {
+                printf("ERROR: extent map is corrupt!\n");
+                return -1;
+        }
+        int written = 0;
+        while(written < nbytes) {
+                int n = file->cur_offset / SFS_EXTENT_SIZE;
+                int offset_in_extent = file->cur_offset % SFS_EXTENT_SIZE;
+                int len = SFS_EXTENT_SIZE - offset_in_extent;
+                if(len > nbytes - written) len = nbytes - written;
+                int elen = sfs_load_extent(disk, file, n);
+                if(elen < 0) {
+                        printf("ERROR: compressed extent %d is corrupt!\n", n);
+                        break;
+                }
+                file->ext_index = -1; // ext_buf is ahead of the disk until the extent is stored
+                memcpy(file->ext_buf + offset_in_extent, (char*)buf + written, len);
+                if(offset_in_extent + len > elen) elen = offset_in_extent + len;
+                int clen = lz4_compress(file->ext_buf, elen, cbuf, SFS_EXTENT_SIZE - 1);
+                if(clen < 0) { // incompressible, store the extent raw
+                        clen = SFS_EXTENT_SIZE;
+                        memcpy(cbuf, file->ext_buf, SFS_EXTENT_SIZE);
+                        elen = SFS_EXTENT_SIZE;
+                }
+                if(sfs_store_extent(disk, inode, file->ext_map, n, cbuf, clen) != 0) break;
+                file->ext_index = n;
+                file->ext_len = elen;
+                file->cur_offset += len;
+                written += len;
+        }
+        disk_write(disk, inode->block[0], 0, file->ext_map, sizeof(file->ext_map));
+        if(file->cur_offset > inode->size) inode->size = file->cur_offset;
+        sfs_write_inode(disk, file->inode_index, inode);
+        if(written == 0 && nbytes > 0) return -1;
+        return written;
+}
+
+/* Read nbytes from a compressed file at its current offset into buf. Only the
+ * extents overlapping the read are decompressed, and the extent map and last
+ * extent are cached in the open file between calls.
+ * Return -1 on failure or the number of bytes successfully read. */
+int sfs_read_compressed(struct sfs_disk* disk, struct sfs_open_file* file, void* buf, int nbytes)
+{
+        struct sfs_inode* inode = &file->inode;
+        if(file->cur_offset + nbytes > inode->size) {
+                nbytes = inode->size - file->cur_offset; // stop at the end of the file
+        }
+        if(sfs_load_extent_map(disk, file) != 0) {
+                printf("ERROR: extent map is corrupt!\n");
+                return -1;
+        }
+        int nread = 0;
+        while(nread < nbytes) {
+                int n = file->cur_offset / SFS_EXTENT_SIZE;
+                int offset_in_extent = file->cur_offset % SFS_EXTENT_SIZE;
+                int len = SFS_EXTENT_SIZE - offset_in_extent;
+                if(len > nbytes - nread) len = nbytes - nread;
+                if(sfs_load_extent(disk, file, n) < 0) {
+                        printf("ERROR: compressed extent %d is corrupt!\n", n);
+                        return -1;
+                }
+                memcpy((char*)buf + nread, file->ext_buf + offset_in_extent, len);
+                file->cur_offset += len;
+                nread += len;
+        }
+        return nread;
+}
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* Hash a full data block with FNV-1a, eight bytes at a time. Matches are
+ * always checked byte by byte, so collisions only cost a compare. */
+uint32_t sfs_hash_block(char* data)
+{
+        uint64_t h = 14695981039346656037ULL;
+        for(int i=0; i < SFS_BLOCK_SIZE; i += 8) {
+                uint64_t word;
+                memcpy(&word, data + i, 8);
+                h = (h ^ word) * 1099511628211ULL;
+        }
+        return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Take a block out of the dedup index if it is in it. */
+void sfs_dedup_remove(struct sfs_disk* disk, int block)
+{
+        uint8_t* link = &disk->dedup_bucket[disk->dedup_hash[block] % SFS_DEDUP_BUCKETS];
+        while(*link != 0) {
+                if(*link == block) {
+                        *link = disk->dedup_next[block];
+                        return;
+                }
+                link = &disk->dedup_next[*link];
+        }
+}
+
+/* Add a block holding data with hash `hash` to the dedup index. */
+static void sfs_dedup_insert(struct sfs_disk* disk, int block, uint32_t hash)
+{
+        sfs_dedup_remove(disk, block);
+        int bucket = hash % SFS_DEDUP_BUCKETS;
+        disk->dedup_hash[block] = hash;
+        disk->dedup_next[block] = disk->dedup_bucket[bucket];
+        disk->dedup_bucket[bucket] = block;
+}
+
+/* Find an indexed block other than `self` holding exactly `data` that can
+ * take another reference. Returns the block, or 0 if there is none. */
+static uint8_t sfs_dedup_find(struct sfs_disk* disk, char* data, uint32_t hash, int self)
+{
+        char buf[SFS_BLOCK_SIZE];
+        for(uint8_t b = disk->dedup_bucket[hash % SFS_DEDUP_BUCKETS]; b != 0; b = disk->dedup_next[b]) {
+                if(b == self || disk->dedup_hash[b] != hash) continue;
+                int ref = sfs_get_ref(disk, b);
+                if(ref <= 0 || ref == SFS_MAX_REFS) continue;
+                if(disk_read(disk, b, 0, buf, SFS_BLOCK_SIZE) != 0) continue; // never share a corrupt block
+                if(memcmp(buf, data, SFS_BLOCK_SIZE) == 0) return b;
+        }
+        return 0;
+}
+
+/* Clear the dedup index and, on a dedup image, index every full data block of
+ * every file. Called at mount since the index isn't stored on disk. */
+void sfs_dedup_rebuild(struct sfs_disk* disk)
+{
+        char buf[SFS_BLOCK_SIZE];
+        struct sfs_inode inode;
+        memset(disk->dedup_bucket, 0, sizeof(disk->dedup_bucket));
+        memset(disk->dedup_hash, 0, sizeof(disk->dedup_hash));
+        if((disk->super.flags & SFS_FLAG_DEDUP) == 0) return;
+        for(int i=1; i < disk->super.used_inodes; i++) {
+                sfs_read_inode(disk, i, &inode);
+                if(inode.type != 1) continue;
+                for(int n=0; n < inode.used_blocks && (n + 1) * SFS_BLOCK_SIZE <= inode.size; n++) {
+                        disk_read(disk, inode.block[n], 0, buf, SFS_BLOCK_SIZE);
+                        sfs_dedup_insert(disk, inode.block[n], sfs_hash_block(buf));
+                }
+        }
+}
+
+/* Called after block `n` of a file has been completely filled. If another
+ * block already holds the same data, point the inode at it and free ours,
+ * otherwise index ours. Once a block has SFS_MAX_REFS references ours is
+ * indexed next to it and later copies share ours instead. Candidates that
+ * fail their checksum are skipped. The caller must write the inode back to
+ * disk. Returns the block now used for `n`, or 0 if the block itself failed
+ * its checksum, in which case it is left as it is and not indexed. */
+uint8_t sfs_dedup_block(struct sfs_disk* disk, struct sfs_inode* inode, int n)
+{
+        char buf[SFS_BLOCK_SIZE];
+        uint8_t block = inode->block[n];
+        if(disk_read(disk, block, 0, buf, SFS_BLOCK_SIZE) != 0) return 0;
+        uint32_t hash = sfs_hash_block(buf);
+        uint8_t match = sfs_dedup_find(disk, buf, hash, block);
+        if(match == 0 || sfs_ref_block(disk, match) != 0) {
+                sfs_dedup_insert(disk, block, hash);
+                return block;
+        }
+        sfs_dedup_remove(disk, block);
+        sfs_unref_block(disk, block);
+        inode->block[n] = match;
+        return match;
+}
@@ -21,7 +21,7 @@ int sfs_read_dir_entry(struct sfs_disk* disk, struct sfs_inode* dir_inode,
         // remember, if the strlen field in the dir_entry is 0 that means it is unused
         // return 0 if this is a valid dir entry, or -1 if it is unused.
 
-        disk_read(disk->data, dir_block, dir_offset, dir, SFS_DIR_ENTRY_SIZE);
+        disk_read(disk, dir_block, dir_offset, dir, SFS_DIR_ENTRY_SIZE);
 
         if(dir->strlen == 0) return -1;
 
@@ -29,57 +29,116 @@ int sfs_read_dir_entry(struct sfs_disk* disk, struct sfs_inode* dir_inode,
         //return -1;
 }
 
-/* Create a new file entry in a directory based on info in `direntry`. Returns 0
- * index of the entry or -1 on failure */
+/* Create a new file entry in a directory based on info in `direntry`.
+ * dir_inum is the directory's inode number, so its inode can be written back
+ * when the directory grows. Returns 0 index of the entry or -1 on failure */
 int sfs_create_dir_entry(struct sfs_disk* disk, struct sfs_inode* dir_inode,
-        struct sfs_dir_entry* direntry)
+        int dir_inum, struct sfs_dir_entry* direntry)
 {
-        int dir_block_index = 0; // TODO: currently only support using the first data block in an inode
-        int n; // FIXME: this should be the index of the new entry
+        int dir_block_index, dir_block;
+        int n; // index of the new entry
         /* for example n=0 means this is the first entry in the data block
          * and n=7 is the last entry in the data block, since we can fit 8 dir entries per block (128/16)
-         * and n=12 would be an entry in the second data block (once we add support for multi-block dirs!)*/
-        int dir_block = dir_inode->block[dir_block_index];  // FIXME: this should be the actual block ID to write to
-        //int dir_offset; // FIXME: this should be the byte offset inside the block to write to (based on n)
-
-        // Read through the dir_entries currently stored on disk to find an empty one (n)
-        // then figure out which block that is and what offset it is within the block
-
-        /* Note: we should implement read_dir_entry first, since this function will need to
-         * read through the dir_entries in the dir_inode's data block until it finds an unused one.
-         * Once we find a free entry on disk, write the values from direntry into it. */
+         * and n=12 is an entry in the second data block. When every entry is
+         * in use, a new zeroed data block is added to the directory. */
 
         struct sfs_dir_entry* frame = malloc(SFS_DIR_ENTRY_SIZE);
-        for(n = 0; n < 8; n++) {
-                if(sfs_read_dir_entry(disk, dir_inode, n, frame) == -1) {
-                        int dir_block_index = n >> 3;
-                        int dir_block = dir_inode->block[dir_block_index];
-                        int dir_offset = n & 7;
-
-                        disk_write(disk->data, dir_block, n*SFS_DIR_ENTRY_SIZE, direntry, SFS_DIR_ENTRY_SIZE);
-                        return 0;
-                }
+        int max_entries = dir_inode->used_blocks * SFS_BLOCK_SIZE / SFS_DIR_ENTRY_SIZE;
+        for(n = 0; n < max_entries; n++) {
+                if(sfs_read_dir_entry(disk, dir_inode, n, frame) == -1) break;
+        }
+        free(frame);
+        if(n == max_entries) { // every block is full, so grow the directory
+                if(dir_inode->used_blocks >= SFS_BLOCKS_PER_INODE) return -1;
+                char zero[SFS_BLOCK_SIZE];
+                uint8_t block = sfs_get_free_block(disk);
+                if(block == 0) return -1;
+                memset(zero, 0, SFS_BLOCK_SIZE);
+                disk_write(disk, block, 0, zero, SFS_BLOCK_SIZE);
+                dir_inode->block[dir_inode->used_blocks++] = block;
+                sfs_write_inode(disk, dir_inum, dir_inode);
         }
+        dir_block_index = n >> 3;
+        dir_block = dir_inode->block[dir_block_index];
+        int dir_offset = (n & 7) * SFS_DIR_ENTRY_SIZE;
+
+        // the directory block may be shared with a snapshot
+        int cow_block = sfs_cow_block(disk, dir_inode, dir_block_index);
+        if(cow_block == 0) return -1;
+        if(cow_block != dir_block) {
+                dir_block = cow_block;
+                sfs_write_inode(disk, dir_inum, dir_inode);
+        }
+        return disk_write(disk, dir_block, dir_offset, direntry, SFS_DIR_ENTRY_SIZE);
+}
 
-        return -1;
-        //return -1;
+/* Read up to `max` used entries of a directory into `entries`, with their
+ * inodes. *cursor is the entry to continue from: set it to 0 to start, and
+ * each call moves it past the entries returned. Directory blocks are read
+ * whole, and the inodes of the batch are read with sfs_read_inodes, so a
+ * batch costs one read per directory block and one per inode block instead
+ * of one inode read per entry. Returns the number of entries read, 0 once the
+ * whole directory has been read, or -1 on failure. */
+int sfs_readdir(struct sfs_disk* disk, struct sfs_inode* dir_inode, int* cursor,
+        struct sfs_dirent* entries, int max)
+{
+        char buf[SFS_BLOCK_SIZE];
+        struct sfs_dir_entry dir;
+        int count = 0;
+        int entries_per_block = SFS_BLOCK_SIZE / SFS_DIR_ENTRY_SIZE;
+        int max_entries = dir_inode->used_blocks * entries_per_block;
+        if(dir_inode->type != 2) {
+                printf("ERROR: tried to read a non-directory inode\n");
+                return -1;
+        }
+        if(*cursor < 0 || max <= 0) return -1;
+        uint8_t* inums = malloc(max);
+        struct sfs_inode* inodes = malloc(max * sizeof(struct sfs_inode));
+        if(inums == NULL || inodes == NULL) {
+                free(inums);
+                free(inodes);
+                return -1;
+        }
+        int n = *cursor;
+        while(n < max_entries && count < max) {
+                if((n == *cursor || n % entries_per_block == 0)
+                        && disk_read(disk, dir_inode->block[n / entries_per_block], 0, buf, SFS_BLOCK_SIZE) != 0) {
+                        free(inums);
+                        free(inodes);
+                        return -1;
+                }
+                memcpy(&dir, &buf[(n % entries_per_block) * SFS_DIR_ENTRY_SIZE], SFS_DIR_ENTRY_SIZE);
+                n++;
+                if(dir.strlen == 0) continue; // unused
+                memcpy(entries[count].name, dir.name, SFS_NAME_LENGTH);
+                entries[count].inum = dir.inum;
+                inums[count++] = dir.inum;
+        }
+        *cursor = n;
+        int ret = sfs_read_inodes(disk, inums, count, inodes);
+        for(int i=0; i < count && ret == 0; i++) {
+                entries[i].inode = inodes[i];
+        }
+        free(inums);
+        free(inodes);
+        return ret == 0 ? count : -1;
 }
 
 /* List out a directory by scanning all of its data blocks for valid dir_entries. */
 void sfs_ls_dir(struct sfs_disk* disk, struct sfs_inode* dir_inode)
 {
+        struct sfs_dirent entries[SFS_READDIR_BATCH];
+        int cursor = 0;
+        int n;
         if(dir_inode->type != 2) {
                 printf("ERROR: tried to list a non-directory inode\n");
                 return;
         }
         printf("          NAME     TYPE       SIZE         BLOCK LIST\n");
-        int max_used_entries = dir_inode->used_blocks * SFS_BLOCK_SIZE / SFS_DIR_ENTRY_SIZE;
-        for(int n=0; n < max_used_entries; n++) {
-                struct sfs_dir_entry dir;
-                int invalid;
-                invalid = sfs_read_dir_entry(disk, dir_inode, n, &dir);
-                if(invalid == 0) {
-                        sfs_print_dir_entry(disk, &dir);
+        while((n = sfs_readdir(disk, dir_inode, &cursor, entries, SFS_READDIR_BATCH)) > 0) {
+                for(int i=0; i < n; i++) {
+                        printf(" %16s", entries[i].name);
+                        sfs_print_inode(&entries[i].inode);
                 }
         }
 }
@@ -99,8 +158,9 @@ int sfs_find_dir_entry(struct sfs_disk* disk, char* filename, struct sfs_dir_ent
         int n;
         struct sfs_inode* root_dir = &disk->root_dir_inode; // TODO: will need to change this to support nested directories
 
-        for(n = 0; n < 8 * SFS_BLOCKS_PER_INODE; n++){
-                sfs_read_dir_entry(disk, root_dir, n, entry);
+        int max_entries = root_dir->used_blocks * SFS_BLOCK_SIZE / SFS_DIR_ENTRY_SIZE;
+        for(n = 0; n < max_entries; n++){
+                if(sfs_read_dir_entry(disk, root_dir, n, entry) != 0) continue;
                 if(strcmp(entry->name, filename) == 0) return 0;
         }
 
@@ -5,35 +5,81 @@
 
 //#define VERBOSE_DISK
 
-/* Read from an in-memory "disk".
+/* Read from an in-memory "disk". If the disk has a backing file, disk->data
+ * caches its blocks and missing blocks are read from the file. With checksums
+ * on, the first read of a block after mounting verifies it. Metadata blocks
+ * that haven't been initialized since the format read as zeros.
  * inputs:
- *   disk = memory array representing disk
+ *   disk = file system whose data array represents the disk
  *   block = index of the block to read from
  *   offset = byte offset within the block to start read
  *   dst = pointer where disk data will be read into
  *   num_bytes = length of data to read
+ * Returns 0, or -1 if the block failed its checksum.
  */
-static inline void
-disk_read(char* disk, int block, int offset, void* dst, int num_bytes) {
+static inline int
+disk_read(struct sfs_disk* disk, int block, int offset, void* dst, int num_bytes) {
         #ifdef VERBOSE_DISK
                 printf("LOG: read block %d offset %d size %d\n", block, offset, num_bytes);
         #endif
-        memcpy(dst, &disk[block*SFS_BLOCK_SIZE + offset], num_bytes);
+        disk->disk_reads++;
+        if(block < SFS_DATA_BLOCK_START && (disk->super.init_map & (1 << block)) == 0) {
+                memset(dst, 0, num_bytes);
+                return 0;
+        }
+        if(disk->backend != NULL) {
+                sfs_backend_read(disk, block, offset, dst, num_bytes);
+        }
+        else {
+                memcpy(dst, &disk->data[block*SFS_BLOCK_SIZE + offset], num_bytes);
+        }
+        if(disk->super.csum_start != 0 && (disk->csum_ok[block / 8] & (1 << (block % 8))) == 0) {
+                return sfs_csum_verify(disk, block);
+        }
+        return 0;
 }
-/* Write to an in-memory "disk".
+/* Write to an in-memory "disk". If the disk has a backing file, the write
+ * goes through to the file as well. The block is marked dirty so the next
+ * sfs_dump only needs to save the blocks written since the last one. With
+ * checksums on, the block's checksum is stored on the next sfs_csum_flush, or
+ * right away with a backing file since the file outlives the process. A partial
+ * write to a block not verified since mounting verifies it
+ * first, so the rest of the block isn't checksummed if it is corrupt.
+ * The first write to an uninitialized metadata block zeroes the rest of it.
  * inputs:
- *   disk = memory array representing disk
+ *   disk = file system whose data array represents the disk
  *   block = index of the block to write to
  *   offset = byte offset within the block to start write
  *   dst = pointer to data to be written to disk
  *   num_bytes = length of data to read
+ * Returns 0, or -1 if the block failed its checksum and wasn't written.
  */
-static inline void
-disk_write(char* disk, int block, int offset, void* src, int num_bytes) {
+static inline int
+disk_write(struct sfs_disk* disk, int block, int offset, void* src, int num_bytes) {
         #ifdef VERBOSE_DISK
                 printf("LOG: write block %d offset %d size %d\n", block, offset, num_bytes);
         #endif
-        memcpy(&disk[block*SFS_BLOCK_SIZE + offset], src, num_bytes);
+        if(disk->super.csum_start != 0 && (offset != 0 || num_bytes != SFS_BLOCK_SIZE)
+                && (disk->csum_ok[block / 8] & (1 << (block % 8))) == 0) {
+                char byte;
+                if(disk_read(disk, block, 0, &byte, 1) != 0) return -1; // verifies the block
+        }
+        if(block < SFS_DATA_BLOCK_START && (disk->super.init_map & (1 << block)) == 0) {
+                sfs_init_block(disk, block, offset == 0 && num_bytes == SFS_BLOCK_SIZE);
+        }
+        disk->dirty[block / 8] |= 1 << (block % 8);
+        if(disk->backend != NULL) {
+                sfs_backend_write(disk, block, offset, src, num_bytes);
+        }
+        else {
+                memcpy(&disk->data[block*SFS_BLOCK_SIZE + offset], src, num_bytes);
+        }
+        if(disk->super.csum_start != 0) {
+                disk->csum_ok[block / 8] |= 1 << (block % 8); // no need to verify what we just wrote
+                if(disk->backend != NULL) sfs_csum_store(disk, block);
+                else disk->csum_stale[block / 8] |= 1 << (block % 8);
+        }
+        return 0;
 }
 
 #endif
@@ -7,7 +7,8 @@
 #include "disk.h"
 #include "sfs.h"
 
-/* Close a file and zero out the open file struct. Returns 0, or -1 on failure. */
+/* Close a file and zero out the open file struct. The file is closed even if
+ * its delayed data can't be flushed. Returns 0, or -1 on failure. */
 int sfs_close(struct sfs_disk* disk, int filedes)
 {
         struct sfs_open_file* file = &disk->open_list[filedes];
@@ -15,14 +16,17 @@ int sfs_close(struct sfs_disk* disk, int filedes)
                 printf("ERROR: tried to close invalid file descriptor!\n");
                 return -1;
         }
+        int ret = sfs_flush(disk, filedes);
+        sfs_csum_flush(disk);
         memset(file, 0, sizeof(struct sfs_open_file));
         disk->open_files--;
-        return 0;
+        return ret;
 }
 
 /* Open a file and return a file descriptor, or -1 on failure.
  * Fill in the file descriptor offset and inode.
- * If create_flag=1, create a new file, else look for an existing file. */
+ * If create_flag=1, create a new file, else look for an existing file.
+ * If create_flag=2 (SFS_CREATE_COMPRESSED), create a new compressed file. */
 int sfs_open(struct sfs_disk* disk, char* filename, int create_flag)
 {
         int fp = -1;
@@ -57,7 +61,12 @@ int sfs_open(struct sfs_disk* disk, char* filename, int create_flag)
 
                 if(sfs_find_dir_entry(disk, filename, dir) == 0) {
                         int inum = dir->inum;
-                        sfs_write_inode(disk, inum, inode);
+                        file->inode_index = inum;
+                        if(sfs_read_inode(disk, inum, inode) != 0) {
+                                printf("ERROR: inode of %s is corrupt!\n", filename);
+                                free(dir);
+                                return -1;
+                        }
                 }
                 else {
                         printf("ERROR: file could not be found!\n");
@@ -72,11 +81,17 @@ int sfs_open(struct sfs_disk* disk, char* filename, int create_flag)
                 }
                 // prepare inode in memory for the new file, then write to disk
                 inode->type = 1; // type 1 = file
+                if(create_flag == SFS_CREATE_COMPRESSED || (disk->super.flags & SFS_FLAG_COMPRESS)) {
+                        inode->type = 3; // type 3 = compressed file
+                }
                 inode->size = 0; // file is initially empty
                 inode->used_blocks = 0;
                 uint8_t inum = sfs_get_free_inode_index(disk);
                 file->inode_index = inum;
-                sfs_write_inode(disk, inum, inode);
+                if(sfs_write_inode(disk, inum, inode) != 0) {
+                        printf("ERROR: can't write the inode of %s!\n", filename);
+                        return -1;
+                }
                 // prepare directory entry linked to this inode and write to disk
                 struct sfs_dir_entry dir;
                 dir.inum = inum;
@@ -86,11 +101,19 @@ int sfs_open(struct sfs_disk* disk, char* filename, int create_flag)
                 /* Update the parent directory so it has a dir_entry for
                 * the new file. Otherwise we won't be able to open it later! */
                 struct sfs_inode* dir_inode = &disk->root_dir_inode;
-                sfs_create_dir_entry(disk, dir_inode, &dir); // FIXME: make this function work!
+                if(sfs_create_dir_entry(disk, dir_inode, 0, &dir) != 0) {
+                        printf("ERROR: can't add %s to the directory!\n", filename);
+                        return -1;
+                }
         }
         // mark as used and set offset to start of file
         file->used = 1;
         file->cur_offset = 0;
+        file->ra_next = 0;
+        file->ra_window = 0;
+        file->ra_end = 0;
+        file->map_loaded = 0;
+        file->ext_index = -1;
         disk->open_files++;
         return fp;
 }
@@ -105,28 +128,157 @@ int sfs_write(struct sfs_disk* disk, int filedes, void* buf, int nbytes)
         }
         struct sfs_open_file* file = &disk->open_list[filedes];
         struct sfs_inode* inode = &file->inode;
-        if(inode->size + nbytes > SFS_BLOCK_SIZE) {
-                printf("ERROR: SFS does not support files with more than 1 data block!\n");
-                return -1;
+        if(inode->type == 3) {
+                return sfs_write_compressed(disk, file, buf, nbytes);
         }
-        // TODO: Currently only supports one block per file
-        int block, offset_in_block;
-        if(inode->used_blocks == 0) {
-                block = sfs_get_free_block(disk);
-                inode->used_blocks++;
-                inode->block[0] = block;
+        if(file->cur_offset + nbytes > SFS_BLOCKS_PER_INODE * SFS_BLOCK_SIZE) {
+                printf("ERROR: write is larger than the maximum file size!\n");
+                nbytes = SFS_BLOCKS_PER_INODE * SFS_BLOCK_SIZE - file->cur_offset;
         }
-        else {
-                block = inode->block[0];
+        int written = 0;
+        while(written < nbytes) {
+                int n = file->cur_offset / SFS_BLOCK_SIZE;
+                int offset_in_block = file->cur_offset % SFS_BLOCK_SIZE;
+                int len = SFS_BLOCK_SIZE - offset_in_block;
+                if(len > nbytes - written) len = nbytes - written;
+                int block;
+                if(n >= inode->used_blocks && (disk->super.flags & SFS_FLAG_DELALLOC)) {
+                        // hold the data until sfs_flush allocates all the new blocks at once
+                        if(file->delay_buf == NULL) {
+                                file->delay_buf = calloc(SFS_BLOCKS_PER_INODE, SFS_BLOCK_SIZE);
+                                if(file->delay_buf == NULL) {
+                                        printf("ERROR: can't allocate delayed write buffer!\n");
+                                        break; // keep what was written so far
+                                }
+                        }
+                        memcpy(file->delay_buf + file->cur_offset, (char*)buf + written, len);
+                        file->cur_offset += len;
+                        written += len;
+                        continue;
+                }
+                if(n >= inode->used_blocks) {
+                        block = sfs_get_free_block(disk);
+                        if(block != 0) inode->block[inode->used_blocks++] = block;
+                }
+                else {
+                        // copy the block first if a clone or snapshot shares it
+                        block = sfs_cow_block(disk, inode, n);
+                }
+                if(block == 0) break;
+                if(disk_write(disk, block, offset_in_block, (char*)buf + written, len) != 0) break;
+                file->cur_offset += len;
+                written += len;
+                if(disk->super.flags & SFS_FLAG_DEDUP) {
+                        // share the block once it is full, it may still change until then
+                        int end = file->cur_offset > inode->size ? file->cur_offset : inode->size;
+                        if((n + 1) * SFS_BLOCK_SIZE <= end) sfs_dedup_block(disk, inode, n);
+                        else sfs_dedup_remove(disk, block);
+                }
         }
-        offset_in_block = file->cur_offset;
-        disk_write(disk->data, block, offset_in_block, buf, nbytes);
-        file->cur_offset += nbytes;
         // Update file size in inode and write to disk
-        // FIXME: file size doesn't work correctly if you seek back and then write
-        inode->size += nbytes;
+        if(file->cur_offset > inode->size) inode->size = file->cur_offset;
+        if(file->delay_buf != NULL) {
+                // the inode on disk only covers the blocks allocated so far
+                struct sfs_inode allocated = *inode;
+                if(allocated.size > allocated.used_blocks * SFS_BLOCK_SIZE) {
+                        allocated.size = allocated.used_blocks * SFS_BLOCK_SIZE;
+                }
+                if(sfs_write_inode(disk, file->inode_index, &allocated) != 0) return -1;
+        }
+        else if(sfs_write_inode(disk, file->inode_index, inode) != 0) {
+                return -1;
+        }
+        if(written == 0 && nbytes > 0) return -1;
+        return written;
+}
+
+/* Add blocks to a file until it has `count` of them, taking them as one run
+ * right after its last block if possible, then as any one run, then one at a
+ * time. Each new block is filled from `data` (indexed by file offset), or
+ * zeroed if data is NULL. Returns 0, or -1 if the disk is full. */
+static int sfs_allocate_blocks(struct sfs_disk* disk, struct sfs_inode* inode, int count, char* data)
+{
+        char zero[SFS_BLOCK_SIZE];
+        int needed = count - inode->used_blocks;
+        if(needed <= 0) return 0;
+        int hint = inode->used_blocks > 0 ? inode->block[inode->used_blocks - 1] + 1 : 0;
+        int start = sfs_get_free_run(disk, needed, hint);
+        memset(zero, 0, SFS_BLOCK_SIZE);
+        for(int i=0; i < needed; i++) {
+                int n = inode->used_blocks;
+                int block = start != 0 ? start + i : sfs_get_free_block(disk);
+                if(block == 0) return -1;
+                disk_write(disk, block, 0, data != NULL ? data + n * SFS_BLOCK_SIZE : zero, SFS_BLOCK_SIZE);
+                inode->block[inode->used_blocks++] = block;
+                if((disk->super.flags & SFS_FLAG_DEDUP) && (n + 1) * SFS_BLOCK_SIZE <= inode->size) {
+                        sfs_dedup_block(disk, inode, n);
+                }
+        }
+        return 0;
+}
+
+/* Write out data held back by delayed allocation. All of the blocks it needs
+ * are allocated together, so files written a little at a time (or several at
+ * once) still end up contiguous. Called by sfs_close.
+ * Returns 0, or -1 on failure. */
+int sfs_flush(struct sfs_disk* disk, int filedes)
+{
+        if(filedes < 0 || filedes >= SFS_MAX_OPEN_FILES || disk->open_list[filedes].used == 0) {
+                printf("ERROR: tried to flush invalid file descriptor!\n");
+                return -1;
+        }
+        struct sfs_open_file* file = &disk->open_list[filedes];
+        struct sfs_inode* inode = &file->inode;
+        int ret = 0;
+        if(file->delay_buf == NULL) return 0;
+        int count = (inode->size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+        if(sfs_allocate_blocks(disk, inode, count, file->delay_buf) != 0) {
+                printf("ERROR: no space to flush file, data was lost!\n");
+                inode->size = inode->used_blocks * SFS_BLOCK_SIZE;
+                if(file->cur_offset > inode->size) file->cur_offset = inode->size;
+                ret = -1;
+        }
+        free(file->delay_buf);
+        file->delay_buf = NULL;
         sfs_write_inode(disk, file->inode_index, inode);
-        return nbytes;
+        return ret;
+}
+
+/* Reserve space for bytes [offset, offset+len) of an open file as one run of
+ * contiguous blocks when possible, so later writes don't fragment the file.
+ * Like fallocate(2), the file grows to offset+len if it is shorter and the new
+ * space reads as zeros. Returns 0, or -1 on failure. */
+int sfs_fallocate(struct sfs_disk* disk, int filedes, int offset, int len)
+{
+        if(filedes < 0 || filedes >= SFS_MAX_OPEN_FILES || disk->open_list[filedes].used == 0) {
+                printf("ERROR: tried to fallocate invalid file descriptor!\n");
+                return -1;
+        }
+        struct sfs_open_file* file = &disk->open_list[filedes];
+        struct sfs_inode* inode = &file->inode;
+        if(inode->type != 1) {
+                printf("ERROR: fallocate only supports uncompressed files!\n");
+                return -1;
+        }
+        if(offset < 0 || len <= 0 || offset + len > SFS_BLOCKS_PER_INODE * SFS_BLOCK_SIZE) {
+                printf("ERROR: fallocate range is outside the maximum file size!\n");
+                return -1;
+        }
+        if(sfs_flush(disk, filedes) != 0) return -1;
+        int end = offset + len;
+        if(end > inode->size && inode->size % SFS_BLOCK_SIZE != 0) {
+                // zero the rest of the last block so the new space reads as zeros
+                char zero[SFS_BLOCK_SIZE];
+                int tail = inode->size % SFS_BLOCK_SIZE;
+                int block = sfs_cow_block(disk, inode, inode->used_blocks - 1);
+                if(block == 0) return -1;
+                memset(zero, 0, SFS_BLOCK_SIZE);
+                disk_write(disk, block, tail, zero, SFS_BLOCK_SIZE - tail);
+        }
+        int ret = sfs_allocate_blocks(disk, inode, (end + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE, NULL);
+        if(ret == 0 && end > inode->size) inode->size = end;
+        sfs_write_inode(disk, file->inode_index, inode);
+        return ret;
 }
 
 /* Read nbytes from an open file descriptor into buf.
@@ -139,16 +291,31 @@ int sfs_read(struct sfs_disk* disk, int filedes, void* buf, int nbytes)
         }
         struct sfs_open_file* file = &disk->open_list[filedes];
         struct sfs_inode* inode = &file->inode;
-        if(inode->size < nbytes) {
-                printf("ERROR: SFS can't handle too long reads!\n");
-                return -1;
+        if(inode->type == 3) {
+                return sfs_read_compressed(disk, file, buf, nbytes);
+        }
+        if(file->cur_offset + nbytes > inode->size) {
+                nbytes = inode->size - file->cur_offset; // stop at the end of the file
         }
-        int block, offset_in_block;
-        block = inode->block[0]; // TODO: Currently only supports one block per file
-        offset_in_block = file->cur_offset;
-        disk_read(disk->data, block, offset_in_block, buf, nbytes);
-        file->cur_offset += nbytes;
-        return nbytes;
+        if(disk->backend != NULL) {
+                sfs_readahead(disk, file, nbytes);
+        }
+        int nread = 0;
+        while(nread < nbytes) {
+                int n = file->cur_offset / SFS_BLOCK_SIZE;
+                int offset_in_block = file->cur_offset % SFS_BLOCK_SIZE;
+                int len = SFS_BLOCK_SIZE - offset_in_block;
+                if(len > nbytes - nread) len = nbytes - nread;
+                if(n >= inode->used_blocks) { // not allocated yet, still in the delayed buffer
+                        memcpy((char*)buf + nread, file->delay_buf + file->cur_offset, len);
+                }
+                else if(disk_read(disk, inode->block[n], offset_in_block, (char*)buf + nread, len) != 0) {
+                        return -1;
+                }
+                file->cur_offset += len;
+                nread += len;
+        }
+        return nread;
 }
 
 /* Change the read pointer in the file by `offset`.
@@ -201,3 +368,32 @@ int sfs_rm(struct sfs_disk* disk, char* filename){
         printf("ERROR: rm is not yet supported!\n");
         return -1;
 }
+
+/* Create file `dst` sharing all of the data blocks of file `src`. Blocks are
+ * only copied once one of the files writes to them. Returns 0, or -1 on failure. */
+int sfs_clone(struct sfs_disk* disk, char* src, char* dst)
+{
+        struct sfs_dir_entry dir;
+        struct sfs_inode inode;
+        if(strlen(dst) > SFS_NAME_LENGTH - 1) {
+                printf("ERROR: file name %s is too long!\n", dst);
+                return -1;
+        }
+        if(sfs_find_dir_entry(disk, src, &dir) != 0) {
+                printf("ERROR: file could not be found!\n");
+                return -1;
+        }
+        sfs_read_inode(disk, dir.inum, &inode);
+        for(int i=0; i < inode.used_blocks; i++) {
+                if(sfs_ref_block(disk, inode.block[i]) != 0) {
+                        while(--i >= 0) sfs_unref_block(disk, inode.block[i]);
+                        return -1;
+                }
+        }
+        uint8_t inum = sfs_get_free_inode_index(disk);
+        sfs_write_inode(disk, inum, &inode);
+        dir.inum = inum;
+        dir.strlen = strlen(dst);
+        strcpy((char*)&dir.name, dst);
+        return sfs_create_dir_entry(disk, &disk->root_dir_inode, 0, &dir);
+}
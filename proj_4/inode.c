@@ -13,23 +13,28 @@ int sfs_read_inode(struct sfs_disk* disk, int index, struct sfs_inode* inode)
         int block, offset;
         block = SFS_INODE_BLOCK_START + index * SFS_INODE_SIZE / SFS_BLOCK_SIZE;
         offset = (index * SFS_INODE_SIZE) % SFS_BLOCK_SIZE;
-        disk_read(disk->data, block, offset, &inode->type, 1);
-        disk_read(disk->data, block, offset+1, &inode->size, 2);
-        disk_read(disk->data, block, offset+3, &inode->used_blocks, 1);
-        disk_read(disk->data, block, offset+4, &inode->block, SFS_BLOCKS_PER_INODE);
+        int error = disk_read(disk, block, offset, &inode->type, 1);
+        disk_read(disk, block, offset+1, &inode->size, 2);
+        disk_read(disk, block, offset+3, &inode->used_blocks, 1);
+        disk_read(disk, block, offset+4, &inode->block, SFS_BLOCKS_PER_INODE);
+        return error; // -1 if the inode block failed its checksum
 }
 
-/* Write inode at the specified index from the inode struct */
+/* Write inode at the specified index from the inode struct.
+ * Returns 0, or -1 if the inode block failed its checksum. */
 int sfs_write_inode(struct sfs_disk* disk, int index, struct sfs_inode* inode)
 {
         int block, offset;
-        printf("LOG: Writing inode %d\n", index);
+        #ifdef VERBOSE_DISK
+                printf("LOG: Writing inode %d\n", index);
+        #endif
         block = SFS_INODE_BLOCK_START + index * SFS_INODE_SIZE / SFS_BLOCK_SIZE;
         offset = (index * SFS_INODE_SIZE) % SFS_BLOCK_SIZE;
-        disk_write(disk->data, block, offset, &inode->type, 1);
-        disk_write(disk->data, block, offset+1, &inode->size, 2);
-        disk_write(disk->data, block, offset+3, &inode->used_blocks, 1);
-        disk_write(disk->data, block, offset+4, &inode->block, SFS_BLOCKS_PER_INODE);
+        if(disk_write(disk, block, offset, &inode->type, 1) != 0) return -1;
+        disk_write(disk, block, offset+1, &inode->size, 2);
+        disk_write(disk, block, offset+3, &inode->used_blocks, 1);
+        disk_write(disk, block, offset+4, &inode->block, SFS_BLOCKS_PER_INODE);
+        return 0;
 }
 
 /* Print out an inode's type, size, and list of data blocks. */
@@ -46,6 +51,9 @@ void sfs_print_inode(struct sfs_inode* inode)
                 case 2:
                         type = 'D'; // directory
                         break;
+                case 3:
+                        type = 'C'; // compressed file
+                        break;
                 default:
                         printf("\n");
                         printf("ERROR: Invalid inode type\n");
@@ -56,3 +64,84 @@ void sfs_print_inode(struct sfs_inode* inode)
         }
         printf("\n");
 }
+
+/* Make data block `n` of an inode safe to modify. A block shared with a clone
+ * or snapshot is copied into a fresh block and the inode is pointed at the
+ * copy; the caller must write the inode back to disk. Returns the block to
+ * write to, or 0 if there is no space for the copy or the block (or its
+ * reference count) failed its checksum. */
+uint8_t sfs_cow_block(struct sfs_disk* disk, struct sfs_inode* inode, int n)
+{
+        uint8_t block = inode->block[n];
+        int ref = sfs_get_ref(disk, block);
+        if(ref < 0) {
+                return 0;
+        }
+        if(ref <= 1) {
+                return block;
+        }
+        char buf[SFS_BLOCK_SIZE];
+        if(disk_read(disk, block, 0, buf, SFS_BLOCK_SIZE) != 0) {
+                return 0; // don't give a corrupt block a good checksum by copying it
+        }
+        uint8_t copy = sfs_get_free_block(disk);
+        if(copy == 0) {
+                return 0;
+        }
+        disk_write(disk, copy, 0, buf, SFS_BLOCK_SIZE);
+        sfs_unref_block(disk, block);
+        inode->block[n] = copy;
+        return copy;
+}
+
+/* Count the extents (runs of consecutive blocks) in an inode's block list. A
+ * file read front to back needs one disk seek per extent. */
+int sfs_count_extents(struct sfs_inode* inode)
+{
+        int extents = 0;
+        for(int i=0; i < inode->used_blocks; i++) {
+                if(i == 0 || inode->block[i] != inode->block[i-1] + 1) extents++;
+        }
+        return extents;
+}
+
+static int sfs_compare_ints(const void* a, const void* b)
+{
+        return *(const int*)a - *(const int*)b;
+}
+
+/* Read the `n` inodes listed in `index` into `inodes`, in the same order.
+ * The indices are sorted first so each inode block is read from disk once,
+ * however the inodes are spread over the list. n can be at most 65536.
+ * Returns 0, or -1 on failure. */
+int sfs_read_inodes(struct sfs_disk* disk, uint8_t* index, int n, struct sfs_inode* inodes)
+{
+        char buf[SFS_BLOCK_SIZE];
+        int cur_block = -1;
+        if(n > 0x10000) return -1;
+        int* order = malloc(n * sizeof(int));
+        if(order == NULL) return -1;
+        for(int i=0; i < n; i++) {
+                order[i] = index[i] << 16 | i; // sort by inode, remember where it goes
+        }
+        qsort(order, n, sizeof(int), sfs_compare_ints);
+        for(int i=0; i < n; i++) {
+                int inum = order[i] >> 16;
+                struct sfs_inode* inode = &inodes[order[i] & 0xffff];
+                int block = SFS_INODE_BLOCK_START + inum * SFS_INODE_SIZE / SFS_BLOCK_SIZE;
+                int offset = (inum * SFS_INODE_SIZE) % SFS_BLOCK_SIZE;
+                if(block != cur_block) {
+                        if(disk_read(disk, block, 0, buf, SFS_BLOCK_SIZE) != 0) {
+                                free(order);
+                                return -1;
+                        }
+                        cur_block = block;
+                }
+                inode->type = buf[offset];
+                memcpy(&inode->size, &buf[offset+1], 2);
+                inode->used_blocks = buf[offset+3];
+                memcpy(&inode->block, &buf[offset+4], SFS_BLOCKS_PER_INODE);
+        }
+        free(order);
+        return 0;
+}
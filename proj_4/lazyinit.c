@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* Background initializer. The thread zeroes the metadata blocks the file
+ * system hasn't touched yet and records them in `zeroed`. Only the caller's
+ * thread changes disk->super.init_map, so until the thread is joined and adopts them
+ * those blocks still count as uninitialized and read as zeros either way. */
+struct sfs_lazy_init {
+        uint8_t zeroed;                 // blocks zeroed by the thread, same layout as init_map
+        int stop;                       // tells the thread to exit early
+        pthread_mutex_t lock;           // protects the fields above and the zeroing of a block
+        pthread_t thread;
+};
+
+/* Zero a block in place without going through disk_write. */
+static void sfs_zero_block(struct sfs_disk* disk, int block)
+{
+        char zero[SFS_BLOCK_SIZE];
+        memset(zero, 0, SFS_BLOCK_SIZE);
+        if(disk->backend != NULL) {
+                sfs_backend_write(disk, block, 0, zero, SFS_BLOCK_SIZE);
+        }
+        else {
+                memcpy(&disk->data[block*SFS_BLOCK_SIZE], zero, SFS_BLOCK_SIZE);
+        }
+}
+
+/* Called by disk_write before the first write to a metadata block that isn't
+ * initialized yet. Zeroes the block unless the write covers all of it (full=1)
+ * or the background thread already did, and records it in init_map. */
+void sfs_init_block(struct sfs_disk* disk, int block, int full)
+{
+        struct sfs_lazy_init* lazy = disk->lazy;
+        char zero[SFS_BLOCK_SIZE];
+        if(lazy != NULL) pthread_mutex_lock(&lazy->lock);
+        int zeroed = lazy != NULL && (lazy->zeroed & (1 << block));
+        disk->super.init_map |= 1 << block; // set first so the writes below don't come back here
+        if(!full && !zeroed) {
+                memset(zero, 0, SFS_BLOCK_SIZE);
+                disk_write(disk, block, 0, zero, SFS_BLOCK_SIZE);
+        }
+        if(lazy != NULL) pthread_mutex_unlock(&lazy->lock);
+        disk_write(disk, 0, SFS_INIT_MAP_START, &disk->super.init_map, 1);
+}
+
+/* Zero every uninitialized metadata block, one at a time. */
+static void* sfs_lazy_init_thread(void* arg)
+{
+        struct sfs_disk* disk = arg;
+        struct sfs_lazy_init* lazy = disk->lazy;
+        for(int block=1; block < SFS_DATA_BLOCK_START; block++) {
+                pthread_mutex_lock(&lazy->lock);
+                if(lazy->stop) {
+                        pthread_mutex_unlock(&lazy->lock);
+                        break;
+                }
+                if((disk->super.init_map & (1 << block)) == 0) {
+                        sfs_zero_block(disk, block);
+                        lazy->zeroed |= 1 << block;
+                }
+                pthread_mutex_unlock(&lazy->lock);
+        }
+        return NULL;
+}
+
+/* Start a thread that finishes initializing the disk in the background. The
+ * file system can be used as normal in the meantime. Returns 0, or -1 on
+ * failure. */
+int sfs_lazy_init_start(struct sfs_disk* disk)
+{
+        if(disk->lazy != NULL) return 0;
+        struct sfs_lazy_init* lazy = calloc(1, sizeof(struct sfs_lazy_init));
+        if(lazy == NULL) {
+                printf("ERROR: can't allocate lazy init state!\n");
+                return -1;
+        }
+        pthread_mutex_init(&lazy->lock, NULL);
+        disk->lazy = lazy;
+        if(pthread_create(&lazy->thread, NULL, sfs_lazy_init_thread, disk) != 0) {
+                printf("ERROR: can't start lazy init thread!\n");
+                pthread_mutex_destroy(&lazy->lock);
+                free(lazy);
+                disk->lazy = NULL;
+                return -1;
+        }
+        return 0;
+}
+
+/* Join the background initializer, after telling it to stop early if stop=1,
+ * and mark the blocks it zeroed as initialized. */
+static void sfs_lazy_init_join(struct sfs_disk* disk, int stop)
+{
+        struct sfs_lazy_init* lazy = disk->lazy;
+        if(lazy == NULL) return;
+        pthread_mutex_lock(&lazy->lock);
+        lazy->stop = stop;
+        pthread_mutex_unlock(&lazy->lock);
+        pthread_join(lazy->thread, NULL);
+        disk->lazy = NULL;
+        uint8_t adopted = lazy->zeroed & ~disk->super.init_map;
+        for(int block=1; block < SFS_DATA_BLOCK_START; block++) {
+                if((adopted & (1 << block)) == 0) continue;
+                // the block changed behind disk_write's back
+                disk->dirty[block / 8] |= 1 << (block % 8);
+                if(disk->super.csum_start != 0) {
+                        disk->csum_stale[block / 8] |= 1 << (block % 8);
+                        disk->csum_ok[block / 8] |= 1 << (block % 8);
+                }
+        }
+        if(adopted != 0) {
+                disk->super.init_map |= adopted;
+                disk_write(disk, 0, SFS_INIT_MAP_START, &disk->super.init_map, 1);
+        }
+        pthread_mutex_destroy(&lazy->lock);
+        free(lazy);
+}
+
+/* Wait for the background initializer to finish the whole disk. */
+void sfs_lazy_init_wait(struct sfs_disk* disk)
+{
+        sfs_lazy_init_join(disk, 0);
+}
+
+/* Stop the background initializer if it is running, keeping the blocks it
+ * has zeroed so far. Called by sfs_format, sfs_mount and sfs_backend_close. */
+void sfs_lazy_init_stop(struct sfs_disk* disk)
+{
+        sfs_lazy_init_join(disk, 1);
+}
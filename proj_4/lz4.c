@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_HASH_LOG 10         // log2 of the match finder table size
+#define LZ4_MIN_MATCH 4         // shortest match the format can encode
+#define LZ4_LAST_LITERALS 5     // the last bytes of a block are always literals
+#define LZ4_MF_LIMIT 12         // a match can't start in the last bytes of a block
+
+static uint32_t lz4_read32(const uint8_t* p)
+{
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+        return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Write a length continuation (the part that didn't fit in the token). */
+static uint8_t* lz4_write_length(uint8_t* op, int len)
+{
+        while(len >= 255) {
+                *op++ = 255;
+                len -= 255;
+        }
+        *op++ = len;
+        return op;
+}
+
+/* Emit one sequence: literals followed by an optional match (mlen=0 for the
+ * final literal-only sequence). Returns the new output pointer or NULL. */
+static uint8_t* lz4_emit(uint8_t* op, uint8_t* oend, const uint8_t* lit, int litlen,
+        int offset, int mlen)
+{
+        int need = 1 + litlen + litlen / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+        if(op + need > oend) return NULL;
+        uint8_t* token = op++;
+        *token = (litlen >= 15 ? 15 : litlen) << 4;
+        if(litlen >= 15) op = lz4_write_length(op, litlen - 15);
+        memcpy(op, lit, litlen);
+        op += litlen;
+        if(mlen == 0) return op;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        mlen -= LZ4_MIN_MATCH;
+        *token |= (mlen >= 15 ? 15 : mlen);
+        if(mlen >= 15) op = lz4_write_length(op, mlen - 15);
+        return op;
+}
+
+int lz4_compress(const char* src, int srclen, char* dst, int dstcap)
+{
+        int table[1 << LZ4_HASH_LOG]; // position + 1 of the last match candidate
+        const uint8_t* in = (const uint8_t*) src;
+        const uint8_t* ip = in;
+        const uint8_t* anchor = in;
+        const uint8_t* end = in + srclen;
+        uint8_t* op = (uint8_t*) dst;
+        uint8_t* oend = op + dstcap;
+        memset(table, 0, sizeof(table));
+        if(srclen > LZ4_MF_LIMIT) {
+                const uint8_t* mflimit = end - LZ4_MF_LIMIT;
+                const uint8_t* matchlimit = end - LZ4_LAST_LITERALS;
+                while(ip < mflimit) {
+                        uint32_t seq = lz4_read32(ip);
+                        uint32_t h = lz4_hash(seq);
+                        int cand = table[h] - 1;
+                        table[h] = ip - in + 1;
+                        if(cand < 0 || ip - (in + cand) > 65535 || lz4_read32(in + cand) != seq) {
+                                ip++;
+                                continue;
+                        }
+                        const uint8_t* ref = in + cand + LZ4_MIN_MATCH;
+                        const uint8_t* m = ip + LZ4_MIN_MATCH;
+                        while(m < matchlimit && *m == *ref) {
+                                m++;
+                                ref++;
+                        }
+                        op = lz4_emit(op, oend, anchor, ip - anchor, ip - (in + cand), m - ip);
+                        if(op == NULL) return -1;
+                        ip = anchor = m;
+                }
+        }
+        op = lz4_emit(op, oend, anchor, end - anchor, 0, 0);
+        if(op == NULL) return -1;
+        return op - (uint8_t*) dst;
+}
+
+int lz4_decompress(const char* src, int srclen, char* dst, int dstcap)
+{
+        const uint8_t* ip = (const uint8_t*) src;
+        const uint8_t* iend = ip + srclen;
+        uint8_t* op = (uint8_t*) dst;
+        uint8_t* oend = op + dstcap;
+        while(ip < iend) {
+                int token = *ip++;
+                int len = token >> 4;
+                if(len == 15) {
+                        int b;
+                        do {
+                                if(ip >= iend) return -1;
+                                b = *ip++;
+                                len += b;
+                        } while(b == 255);
+                }
+                if(ip + len > iend || op + len > oend) return -1;
+                memcpy(op, ip, len);
+                op += len;
+                ip += len;
+                if(ip >= iend) break; // the last sequence has no match
+                if(ip + 2 > iend) return -1;
+                int offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                if(offset == 0 || offset > op - (uint8_t*) dst) return -1;
+                len = token & 15;
+                if(len == 15) {
+                        int b;
+                        do {
+                                if(ip >= iend) return -1;
+                                b = *ip++;
+                                len += b;
+                        } while(b == 255);
+                }
+                len += LZ4_MIN_MATCH;
+                if(op + len > oend) return -1;
+                const uint8_t* match = op - offset;
+                if(offset >= len) {
+                        memcpy(op, match, len);
+                        op += len;
+                }
+                else {
+                        while(len-- > 0) *op++ = *match++; // the match overlaps the output
+                }
+        }
+        return op - (uint8_t*) dst;
+}
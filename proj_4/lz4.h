@@ -0,0 +1,15 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+/* Minimal LZ4 block format compressor and decompressor used for compressed
+ * SFS files. Inputs must be smaller than 64KB. */
+
+/* Compress srclen bytes of src into dst. Returns the compressed length, or -1
+ * if the result doesn't fit in dstcap bytes. */
+int lz4_compress(const char* src, int srclen, char* dst, int dstcap);
+
+/* Decompress srclen bytes of LZ4 data from src into dst. Returns the
+ * decompressed length, or -1 if the data is corrupt or too big for dstcap. */
+int lz4_decompress(const char* src, int srclen, char* dst, int dstcap);
+
+#endif
@@ -11,10 +11,56 @@
 #define SFS_INODE_BLOCK_START 3 // block number for start of inode
 #define SFS_NAME_LENGTH 14      // maximum length of a file's name
 #define SFS_DIR_ENTRY_SIZE 16   // size of a directory entry in bytes
+#define SFS_REFCOUNT_BLOCK_START 1 // block number for start of block reference counts
+#define SFS_INODE_BLOCKS 5      // number of blocks holding the inode table
+#define SFS_MAX_SNAPSHOTS 4     // maximum snapshots kept at the same time
+#define SFS_MAX_REFS 255        // most references a block can have (one byte count per block)
+#define SFS_SNAPSHOT_START 8    // byte offset of the snapshot table in the super block
+#define SFS_SNAPSHOT_SIZE 8     // size of a snapshot record in bytes
+#define SFS_INIT_MAP_START 40   // byte offset of init_map in the super block, after the snapshot table
+#define SFS_EXTENT_SIZE 512     // bytes of file data per compressed extent
+#define SFS_MAX_EXTENTS 64      // extents per compressed file (entries in its map block)
+#define SFS_DEDUP_BUCKETS 64    // hash buckets in the in-memory dedup index
+#define SFS_RA_MIN_BLOCKS 2     // first readahead window for sequential reads
+#define SFS_RA_MAX_BLOCKS 16    // largest readahead window
+#define SFS_RING_SIZE 256       // entries in an async submission or completion ring
+#define SFS_DUMP_MAGIC 0x53465344 // identifies a dump file ("SFSD")
+#define SFS_DUMP_NAME_LENGTH 256 // maximum length of a dump file path
+#define SFS_MAX_DUMP_CHAIN 64   // maximum deltas applied on top of a full dump
+#define SFS_READDIR_BATCH 32    // entries sfs_ls_dir asks sfs_readdir for at a time
+#define SFS_CSUM_SIZE 4         // bytes per block checksum (CRC32C)
+#define SFS_CSUM_BLOCKS 8       // blocks in the checksum region, one checksum for every block on disk
+
+/* Super block flags chosen at format time */
+#define SFS_FLAG_COMPRESS 1     // create every new file compressed
+#define SFS_FLAG_DEDUP 2        // share identical full data blocks between files
+#define SFS_FLAG_DELALLOC 4     // allocate blocks when a file is flushed, not on each write
+#define SFS_FLAG_CHECKSUM 8     // checksum the refcount and inode blocks
+#define SFS_FLAG_CHECKSUM_DATA 16 // checksum data blocks as well (implies SFS_FLAG_CHECKSUM)
+
+/* Operations for the async ring */
+#define SFS_OP_OPEN 1           // sfs_open(filename, create_flag)
+#define SFS_OP_READ 2           // sfs_read(filedes, buf, nbytes) at offset
+#define SFS_OP_WRITE 3          // sfs_write(filedes, buf, nbytes) at offset
+#define SFS_OP_CLOSE 4          // sfs_close(filedes)
+
+/* create_flag values for sfs_open */
+#define SFS_CREATE 1            // create a new file
+#define SFS_CREATE_COMPRESSED 2 // create a new compressed file
 
 /*************** SFS ON-DISK DATA STRUCTS ***************/
 /* These structs represent data stored on disk. */
 
+/* A snapshot is a frozen copy of the inode table. The copy lives in data
+ * blocks, and every data block referenced by the frozen inodes has its
+ * reference count raised so it can't be changed or freed underneath it.
+ * Stored in the super block starting at SFS_SNAPSHOT_START. */
+struct sfs_snapshot { // SFS_SNAPSHOT_SIZE = 8 bytes per snapshot
+        uint8_t used;           // is this snapshot in use? 0=unused 1=used
+        uint8_t used_inodes;    // used inodes when the snapshot was taken
+        uint8_t inode_block[SFS_INODE_BLOCKS]; // blocks holding the inode table copy
+};
+
 /* Super block meta data about the disk. Stored in block 0. */
 struct sfs_super {
         uint16_t magic;         // magic number to identify FS=466
@@ -22,13 +68,21 @@ struct sfs_super {
         uint8_t data_blocks;    // total blocks allocated for data
         uint8_t used_inodes;    // currently used inodes (each inode is smaller than a block)
         uint8_t used_data;      // currently used data blocks
+        uint8_t flags;          // SFS_FLAG_* options chosen at format time
+        uint8_t csum_start;     // first block of the checksum region, 0=no checksums
+        struct sfs_snapshot snapshot[SFS_MAX_SNAPSHOTS]; // snapshot table
+        uint8_t init_map;       // bit n is set once block n (below SFS_DATA_BLOCK_START) has been zeroed
 };
 
 /* inodes represent files or directories. An inode contains direct pointers
  * to the data blocks holding file contents or directory listings. The direct
- * pointers are the block index within the disk where the data is located. */
+ * pointers are the block index within the disk where the data is located.
+ * A compressed file stores its data in LZ4 compressed extents of
+ * SFS_EXTENT_SIZE bytes. block[0] is a map block holding the 16 bit compressed
+ * length of each extent (0 for a hole, SFS_EXTENT_SIZE if stored raw), and the
+ * remaining blocks hold the extents back to back in extent order. */
 struct sfs_inode { // SFS_INODE_SIZE = 32 bytes per inode
-        uint8_t type;           // 0=unused, 1=file, 2=dir
+        uint8_t type;           // 0=unused, 1=file, 2=dir, 3=compressed file
         uint16_t size;          // total data size in bytes
         uint8_t used_blocks;    // total used blocks
         uint8_t block[SFS_BLOCKS_PER_INODE]; // list of block indices
@@ -55,6 +109,57 @@ struct sfs_open_file {
         int cur_offset; // current offset for reading or writing in the file
         struct sfs_inode inode; // inode for file
         uint8_t inode_index; // inode number for file
+        int ra_next;    // offset a sequential read would start at
+        int ra_window;  // readahead window in blocks, 0=not reading sequentially
+        int ra_end;     // file block index after the last one prefetched
+        char* delay_buf; // data for blocks not allocated yet (delayed allocation), indexed by file offset
+        int map_loaded; // 1 once ext_map holds a compressed file's extent map
+        uint16_t ext_map[SFS_MAX_EXTENTS]; // extent map of a compressed file, kept in step with its map block
+        int ext_index;  // extent decompressed in ext_buf, -1 if none
+        int ext_len;    // length of that extent (0 for a hole)
+        char ext_buf[SFS_EXTENT_SIZE]; // last extent of a compressed file read or written
+};
+
+/* A directory entry returned by sfs_readdir, along with the entry's inode. */
+struct sfs_dirent {
+        char name[SFS_NAME_LENGTH];     // null terminated file name string
+        uint8_t inum;                   // inode index number for this file/dir
+        struct sfs_inode inode;         // the entry's inode, for its type, size and blocks
+};
+
+/* An operation submitted to an async ring. */
+struct sfs_sqe {
+        int op;                 // SFS_OP_* operation to run
+        int filedes;            // file descriptor for read, write and close
+        char* filename;         // file name for open
+        int create_flag;        // create_flag for open
+        void* buf;              // buffer for read and write
+        int nbytes;             // bytes to read or write
+        int offset;             // file offset for read and write (like pread/pwrite), -1 for the current offset
+        uint64_t user_data;     // tag handed back with the completion
+};
+
+/* The result of an operation, reaped from an async ring. */
+struct sfs_cqe {
+        uint64_t user_data;     // tag from the sfs_sqe
+        int result;             // return value of the operation
+};
+
+struct sfs_backend; // backing file state, private to backend.c
+struct sfs_ring;    // async ring state, private to async.c
+struct sfs_lazy_init; // background initializer state, private to lazyinit.c
+
+/* Header of a file written by sfs_dump. It is followed by `blocks` records,
+ * each a 16 bit block index and the block's data. A full dump has no parent
+ * and holds every block. A delta holds the blocks written since its parent
+ * dump and is restored by first restoring the parent. Each dump has an id so a
+ * delta can tell when its parent's file has been replaced by another dump. */
+struct sfs_dump_header {
+        uint32_t magic;         // SFS_DUMP_MAGIC
+        uint16_t blocks;        // number of block records that follow
+        uint32_t id;            // identifies this dump
+        uint32_t parent_id;     // id of the parent dump, 0 for a full dump
+        char parent[SFS_DUMP_NAME_LENGTH]; // dump this delta applies to, empty for a full dump
 };
 
 /* This represents the overall disk and file system. Normally it would have
@@ -63,32 +168,62 @@ struct sfs_open_file {
  * memory referenced by this struct. */
 struct sfs_disk {
         char* data;                     // in-memory array representing the disk
+        struct sfs_backend* backend;    // backing file cached by data, or NULL
+        struct sfs_lazy_init* lazy;     // background initializer thread, or NULL
+        int device_reads;               // reads issued to the backing file
+        long disk_reads;                // disk_read calls, for benchmarks
+        int device_latency_us;          // simulated latency of each read from the backing file
         struct sfs_super super;         // super block of the disk
         struct sfs_open_file open_list[SFS_MAX_OPEN_FILES]; // array that stores info about open files
         int open_files;                 // number of files currently open
         struct sfs_inode root_dir_inode;// inode of the root directory so we can find files
+        /* Dedup index from block hash to data block, rebuilt at mount. Each
+         * bucket is a list of blocks linked through dedup_next, 0 ends a list. */
+        uint8_t dedup_bucket[SFS_DEDUP_BUCKETS]; // first block in each bucket
+        uint8_t dedup_next[SFS_NUM_BLOCKS];      // next block in the same bucket
+        uint32_t dedup_hash[SFS_NUM_BLOCKS];     // hash of each indexed block
+        uint8_t dirty[SFS_NUM_BLOCKS / 8];       // blocks written since the last dump, one bit per block
+        char dump_name[SFS_DUMP_NAME_LENGTH];    // last dump written or mounted, parent of the next delta
+        uint32_t dump_id;                        // id of that dump
+        uint8_t csum_ok[SFS_NUM_BLOCKS / 8];     // blocks verified or written since mount, one bit per block
+        uint8_t csum_stale[SFS_NUM_BLOCKS / 8];  // blocks written since their checksum was stored
 };
 
 // super block functions
 int sfs_format(struct sfs_disk* disk);
+int sfs_format_flags(struct sfs_disk* disk, uint8_t flags);
 int sfs_mount(struct sfs_disk* disk, char* dump_file_name);
 int sfs_read_super(struct sfs_disk* disk);
 int sfs_write_super(struct sfs_disk* disk, struct sfs_super* super);
 void sfs_print_super(struct sfs_super* super);
 uint8_t sfs_get_free_block(struct sfs_disk* disk);
+uint8_t sfs_get_free_run(struct sfs_disk* disk, int n, int hint);
 uint8_t sfs_get_free_inode_index(struct sfs_disk* disk);
 int sfs_dump(struct sfs_disk* disk, char* dump_file_name);
+int sfs_get_ref(struct sfs_disk* disk, int block);
+int sfs_ref_block(struct sfs_disk* disk, int block);
+int sfs_unref_block(struct sfs_disk* disk, int block);
+
+// snapshot functions
+int sfs_snapshot(struct sfs_disk* disk);
+int sfs_snapshot_restore(struct sfs_disk* disk, int id);
+int sfs_snapshot_delete(struct sfs_disk* disk, int id);
 
 // inode functions
 int sfs_read_inode(struct sfs_disk* disk, int index, struct sfs_inode* inode);
 int sfs_write_inode(struct sfs_disk* disk, int index, struct sfs_inode* inode);
 void sfs_print_inode(struct sfs_inode* inode);
+uint8_t sfs_cow_block(struct sfs_disk* disk, struct sfs_inode* inode, int n);
+int sfs_count_extents(struct sfs_inode* inode);
+int sfs_read_inodes(struct sfs_disk* disk, uint8_t* index, int n, struct sfs_inode* inodes);
 
 // Directory functions
 int sfs_create_dir_entry(struct sfs_disk* disk, struct sfs_inode* dir_inode,
-        struct sfs_dir_entry* dir);
+        int dir_inum, struct sfs_dir_entry* dir);
 int sfs_read_dir_entry(struct sfs_disk* disk, struct sfs_inode* dir_inode,
         int n, struct sfs_dir_entry* dir);
+int sfs_readdir(struct sfs_disk* disk, struct sfs_inode* dir_inode, int* cursor,
+        struct sfs_dirent* entries, int max);
 void sfs_ls_dir(struct sfs_disk* disk, struct sfs_inode* dir_inode);
 void sfs_print_dir_entry(struct sfs_disk* disk, struct sfs_dir_entry* dir);
 int sfs_find_dir_entry(struct sfs_disk* disk, char* filename, struct sfs_dir_entry* entry);
@@ -101,5 +236,45 @@ int sfs_write(struct sfs_disk* disk, int filedes, void* buf, int nbytes);
 int sfs_close(struct sfs_disk* disk, int filedes);
 int sfs_rm(struct sfs_disk* disk, char* filename);
 int sfs_seek(struct sfs_disk* disk, int filedes, int offset, int option);
+int sfs_clone(struct sfs_disk* disk, char* src, char* dst);
+int sfs_flush(struct sfs_disk* disk, int filedes);
+int sfs_fallocate(struct sfs_disk* disk, int filedes, int offset, int len);
+
+// checksum functions
+uint32_t sfs_crc32c(const void* data, int len);
+void sfs_csum_store(struct sfs_disk* disk, int block);
+void sfs_csum_flush(struct sfs_disk* disk);
+int sfs_csum_verify(struct sfs_disk* disk, int block);
+
+// lazy initialization functions
+void sfs_init_block(struct sfs_disk* disk, int block, int full);
+int sfs_lazy_init_start(struct sfs_disk* disk);
+void sfs_lazy_init_wait(struct sfs_disk* disk);
+void sfs_lazy_init_stop(struct sfs_disk* disk);
+
+// dedup functions
+uint32_t sfs_hash_block(char* data);
+void sfs_dedup_rebuild(struct sfs_disk* disk);
+void sfs_dedup_remove(struct sfs_disk* disk, int block);
+uint8_t sfs_dedup_block(struct sfs_disk* disk, struct sfs_inode* inode, int n);
+
+// backing file functions
+int sfs_backend_open(struct sfs_disk* disk, char* path, int readahead);
+void sfs_backend_close(struct sfs_disk* disk);
+void sfs_backend_read(struct sfs_disk* disk, int block, int offset, void* dst, int num_bytes);
+void sfs_backend_write(struct sfs_disk* disk, int block, int offset, void* src, int num_bytes);
+void sfs_readahead(struct sfs_disk* disk, struct sfs_open_file* file, int nbytes);
+
+// async ring functions
+struct sfs_ring* sfs_ring_init(struct sfs_disk* disk, int workers);
+void sfs_ring_exit(struct sfs_ring* ring);
+struct sfs_sqe* sfs_ring_get_sqe(struct sfs_ring* ring);
+int sfs_ring_submit(struct sfs_ring* ring);
+int sfs_ring_wait_cqe(struct sfs_ring* ring, struct sfs_cqe* cqe);
+int sfs_ring_peek_cqe(struct sfs_ring* ring, struct sfs_cqe* cqe);
+
+// compressed file operations
+int sfs_read_compressed(struct sfs_disk* disk, struct sfs_open_file* file, void* buf, int nbytes);
+int sfs_write_compressed(struct sfs_disk* disk, struct sfs_open_file* file, void* buf, int nbytes);
 
 #endif
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* Add (delta=1) or drop (delta=-1) a reference to every data block used by the
+ * inodes in an inode table. `table` lists the blocks holding the table, so this
+ * works for both the live table and a snapshot's copy. Returns 0, or -1 if a
+ * block can't take another reference or an inode block failed its checksum,
+ * in which case nothing is changed when adding references. */
+static int sfs_ref_inode_table(struct sfs_disk* disk, uint8_t* table, int used_inodes, int delta)
+{
+        for(int i=0; i < used_inodes; i++) {
+                int block = table[i * SFS_INODE_SIZE / SFS_BLOCK_SIZE];
+                int offset = (i * SFS_INODE_SIZE) % SFS_BLOCK_SIZE;
+                uint8_t type, used_blocks;
+                uint8_t blocks[SFS_BLOCKS_PER_INODE];
+                if(disk_read(disk, block, offset, &type, 1) != 0) {
+                        if(delta > 0) sfs_ref_inode_table(disk, table, i, -1);
+                        return -1;
+                }
+                if(type == 0) continue;
+                disk_read(disk, block, offset+3, &used_blocks, 1);
+                disk_read(disk, block, offset+4, blocks, SFS_BLOCKS_PER_INODE);
+                for(int j=0; j < used_blocks; j++) {
+                        if(delta < 0) {
+                                sfs_unref_block(disk, blocks[j]);
+                        }
+                        else if(sfs_ref_block(disk, blocks[j]) != 0) {
+                                // drop the references taken so far
+                                while(--j >= 0) sfs_unref_block(disk, blocks[j]);
+                                sfs_ref_inode_table(disk, table, i, -1);
+                                return -1;
+                        }
+                }
+        }
+        return 0;
+}
+
+/* Fill in the list of blocks holding the live inode table. */
+static void sfs_live_inode_table(uint8_t* table)
+{
+        for(int i=0; i < SFS_INODE_BLOCKS; i++) {
+                table[i] = SFS_INODE_BLOCK_START + i;
+        }
+}
+
+/* Freeze the current inode table and root directory. Only the inode table is
+ * copied; data blocks are shared with the snapshot and copied on the next
+ * write, so the cost depends on the number of inodes and not on file sizes.
+ * Returns the snapshot id, or -1 on failure. */
+int sfs_snapshot(struct sfs_disk* disk)
+{
+        int id = -1;
+        char buf[SFS_BLOCK_SIZE];
+        uint8_t live[SFS_INODE_BLOCKS];
+        for(int i=0; i < SFS_MAX_SNAPSHOTS; i++) {
+                if(disk->super.snapshot[i].used == 0) {
+                        id = i;
+                        break;
+                }
+        }
+        if(id == -1) {
+                printf("ERROR: max snapshot limit reached.\n");
+                return -1;
+        }
+        struct sfs_snapshot* snap = &disk->super.snapshot[id];
+        sfs_live_inode_table(live);
+        for(int i=0; i < SFS_INODE_BLOCKS; i++) {
+                snap->inode_block[i] = sfs_get_free_block(disk);
+                if(snap->inode_block[i] == 0) {
+                        while(--i >= 0) sfs_unref_block(disk, snap->inode_block[i]);
+                        return -1;
+                }
+                if(disk_read(disk, live[i], 0, buf, SFS_BLOCK_SIZE) != 0) {
+                        printf("ERROR: inode table is corrupt!\n");
+                        while(i >= 0) sfs_unref_block(disk, snap->inode_block[i--]);
+                        return -1;
+                }
+                disk_write(disk, snap->inode_block[i], 0, buf, SFS_BLOCK_SIZE);
+        }
+        snap->used_inodes = disk->super.used_inodes;
+        if(sfs_ref_inode_table(disk, live, snap->used_inodes, 1) != 0) {
+                for(int i=0; i < SFS_INODE_BLOCKS; i++) sfs_unref_block(disk, snap->inode_block[i]);
+                return -1;
+        }
+        snap->used = 1;
+        sfs_write_super(disk, &disk->super);
+        return id;
+}
+
+/* Roll the file system back to a snapshot. The snapshot is kept so it can be
+ * restored again. All files must be closed. Returns 0, or -1 on failure. */
+int sfs_snapshot_restore(struct sfs_disk* disk, int id)
+{
+        char buf[SFS_BLOCK_SIZE];
+        uint8_t live[SFS_INODE_BLOCKS];
+        if(id < 0 || id >= SFS_MAX_SNAPSHOTS || disk->super.snapshot[id].used == 0) {
+                printf("ERROR: tried to restore invalid snapshot!\n");
+                return -1;
+        }
+        if(disk->open_files > 0) {
+                printf("ERROR: can't restore a snapshot with files open!\n");
+                return -1;
+        }
+        struct sfs_snapshot* snap = &disk->super.snapshot[id];
+        sfs_live_inode_table(live);
+        // check the snapshot's copy of the table before changing anything
+        for(int i=0; i < SFS_INODE_BLOCKS; i++) {
+                if(disk_read(disk, snap->inode_block[i], 0, buf, SFS_BLOCK_SIZE) != 0) {
+                        printf("ERROR: snapshot %d is corrupt!\n", id);
+                        return -1;
+                }
+        }
+        // reference the snapshot's blocks before dropping the live ones
+        if(sfs_ref_inode_table(disk, snap->inode_block, snap->used_inodes, 1) != 0) return -1;
+        sfs_ref_inode_table(disk, live, disk->super.used_inodes, -1);
+        for(int i=0; i < SFS_INODE_BLOCKS; i++) {
+                disk_read(disk, snap->inode_block[i], 0, buf, SFS_BLOCK_SIZE);
+                disk_write(disk, live[i], 0, buf, SFS_BLOCK_SIZE);
+        }
+        disk->super.used_inodes = snap->used_inodes;
+        sfs_write_super(disk, &disk->super);
+        sfs_read_inode(disk, 0, &disk->root_dir_inode);
+        return 0;
+}
+
+/* Delete a snapshot and drop its references to data blocks.
+ * Returns 0, or -1 on failure. */
+int sfs_snapshot_delete(struct sfs_disk* disk, int id)
+{
+        if(id < 0 || id >= SFS_MAX_SNAPSHOTS || disk->super.snapshot[id].used == 0) {
+                printf("ERROR: tried to delete invalid snapshot!\n");
+                return -1;
+        }
+        struct sfs_snapshot* snap = &disk->super.snapshot[id];
+        sfs_ref_inode_table(disk, snap->inode_block, snap->used_inodes, -1);
+        for(int i=0; i < SFS_INODE_BLOCKS; i++) {
+                sfs_unref_block(disk, snap->inode_block[i]);
+        }
+        snap->used = 0;
+        sfs_write_super(disk, &disk->super);
+        return 0;
+}
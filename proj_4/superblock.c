@@ -3,36 +3,137 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
 
 #include "disk.h"
 #include "sfs.h"
 
-/* Clear "disk" then initialize the magic number, inode,
- * and block counts in a new super block */
+/* Initialize the magic number, inode, and block counts in a new super block.
+ * Other metadata blocks are zeroed on first use, see sfs_format_flags. */
 int sfs_format(struct sfs_disk* disk)
+{
+        return sfs_format_flags(disk, 0);
+}
+
+/* Format the disk with SFS_FLAG_* options, such as compressing every file. */
+int sfs_format_flags(struct sfs_disk* disk, uint8_t flags)
 {
         struct sfs_super super;
         struct sfs_inode root;
-        memset(disk->data, 0, 1);
+        char zero[SFS_BLOCK_SIZE];
+        uint8_t ref = 1;
+        memset(disk->csum_stale, 0, sizeof(disk->csum_stale)); // checksums of the old file system don't matter
+        disk->dump_name[0] = 0; // the next dump starts a new chain
+        if(flags & SFS_FLAG_CHECKSUM_DATA) flags |= SFS_FLAG_CHECKSUM;
         super.magic = SFS_MAGIC;
         /* Disk structure:
          * [SFFIIIIID...D] S=super, F=free map, I=inode block, D=data block
-         * [012345678...255] */
+         * [012345678...255]
+         * The free map holds a one byte reference count per block. With
+         * checksums on, the checksum region takes the last SFS_CSUM_BLOCKS
+         * blocks, out of the way of the block allocator. */
         super.inode_blocks = SFS_DATA_BLOCK_START - SFS_INODE_BLOCK_START;
         super.data_blocks = SFS_NUM_BLOCKS - SFS_DATA_BLOCK_START;
         super.used_inodes = 1;
         super.used_data = 1;
+        super.flags = flags;
+        super.csum_start = 0;
+        memset(super.snapshot, 0, sizeof(super.snapshot));
+        memset(zero, 0, SFS_BLOCK_SIZE);
+        /* Nothing below SFS_DATA_BLOCK_START is zeroed up front. Blocks not
+         * in init_map read as zeros and are zeroed on first write, so format
+         * only writes the blocks it uses. */
+        sfs_lazy_init_stop(disk);
+        disk->super.init_map = 1; // just the super block
+        disk->super.csum_start = 0;
+        if(flags & SFS_FLAG_CHECKSUM) {
+                // clear the checksum region, then checksum everything written from here on
+                super.csum_start = SFS_NUM_BLOCKS - SFS_CSUM_BLOCKS;
+                super.used_data += SFS_CSUM_BLOCKS;
+                for(int i=0; i < SFS_CSUM_BLOCKS; i++) {
+                        disk_write(disk, super.csum_start + i, 0, zero, SFS_BLOCK_SIZE);
+                }
+                memset(disk->csum_ok, 0, sizeof(disk->csum_ok));
+                disk->super.flags = flags;
+                disk->super.csum_start = super.csum_start;
+        }
+        // the root directory block and the checksum region are in use
+        disk_write(disk, SFS_REFCOUNT_BLOCK_START, SFS_DATA_BLOCK_START, &ref, 1);
+        for(int i=0; super.csum_start != 0 && i < SFS_CSUM_BLOCKS; i++) {
+                int block = super.csum_start + i;
+                disk_write(disk, SFS_REFCOUNT_BLOCK_START + block / SFS_BLOCK_SIZE, block % SFS_BLOCK_SIZE, &ref, 1);
+        }
+        disk_write(disk, SFS_DATA_BLOCK_START, 0, zero, SFS_BLOCK_SIZE);
         root.type = 2; // directory inode
         root.size = 0;
         root.used_blocks = 1;
         root.block[0] = SFS_DATA_BLOCK_START; // reserve first data block
+        super.init_map = disk->super.init_map;
         sfs_write_super(disk, &super);
         sfs_write_inode(disk, 0, &root);
         struct sfs_dir_entry root_dir_entry;
         root_dir_entry.inum = 0;
         strcpy((char*)&root_dir_entry.name, "./");
         root_dir_entry.strlen = 2;
-        sfs_create_dir_entry(disk, &root, &root_dir_entry);
+        sfs_create_dir_entry(disk, &root, 0, &root_dir_entry);
+        sfs_csum_flush(disk);
+        return 0;
+}
+
+/* Load a dump written by sfs_dump into the disk. A delta first restores its
+ * parent, so a chain of deltas is applied oldest first on top of its full dump.
+ * depth counts the deltas already followed. The dump's id is stored in *id.
+ * Returns 0, or -1 on failure. */
+static int sfs_restore_dump(struct sfs_disk* disk, char* dump_file_name, int depth, uint32_t* id)
+{
+        struct sfs_dump_header header;
+        uint32_t parent_id;
+        uint16_t block;
+        char buf[SFS_BLOCK_SIZE];
+        FILE* f = fopen(dump_file_name, "rb");
+        if(f == NULL) {
+                printf("ERROR: can't open dump %s\n", dump_file_name);
+                return -1;
+        }
+        if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != SFS_DUMP_MAGIC) {
+                printf("ERROR: %s isn't an SFS dump\n", dump_file_name);
+                fclose(f);
+                return -1;
+        }
+        header.parent[SFS_DUMP_NAME_LENGTH - 1] = 0;
+        if(header.parent[0] != 0) {
+                if(depth == SFS_MAX_DUMP_CHAIN) {
+                        printf("ERROR: dump chain of %s is too long\n", dump_file_name);
+                        fclose(f);
+                        return -1;
+                }
+                if(sfs_restore_dump(disk, header.parent, depth + 1, &parent_id) != 0) {
+                        fclose(f);
+                        return -1;
+                }
+                if(parent_id != header.parent_id) {
+                        printf("ERROR: %s was replaced after %s was written on top of it\n",
+                                header.parent, dump_file_name);
+                        fclose(f);
+                        return -1;
+                }
+        }
+        else if(header.blocks != SFS_NUM_BLOCKS) {
+                printf("ERROR: full dump %s is missing blocks\n", dump_file_name);
+                fclose(f);
+                return -1;
+        }
+        for(int i=0; i < header.blocks; i++) {
+                if(fread(&block, sizeof(block), 1, f) != 1 || fread(buf, SFS_BLOCK_SIZE, 1, f) != 1
+                        || block >= SFS_NUM_BLOCKS) {
+                        printf("ERROR: dump %s is truncated\n", dump_file_name);
+                        fclose(f);
+                        return -1;
+                }
+                disk_write(disk, block, 0, buf, SFS_BLOCK_SIZE);
+        }
+        fclose(f);
+        *id = header.id;
         return 0;
 }
 
@@ -41,42 +142,77 @@ int sfs_format(struct sfs_disk* disk)
  * or it can be NULL to mount a fresh disk. */
 int sfs_mount(struct sfs_disk* disk, char* dump_file_name)
 {
+        sfs_lazy_init_stop(disk);
+        sfs_csum_flush(disk);
+        disk->super.csum_start = 0; // load the dump as is, the super block says where checksums are
+        disk->super.init_map = 0xff; // and don't zero anything, the super block says what is initialized
+        memset(disk->csum_ok, 0, sizeof(disk->csum_ok)); // verify each block on its first read
         if(dump_file_name != NULL) {
-                // TODO: read dump_file_name into disk->data and then read the super (optional)
+                if(sfs_restore_dump(disk, dump_file_name, 0, &disk->dump_id) != 0) return -1;
+                // the disk now matches the dump, so the next dump can be a delta on top of it
+                memset(disk->dirty, 0, sizeof(disk->dirty));
+                snprintf(disk->dump_name, SFS_DUMP_NAME_LENGTH, "%s", dump_file_name);
         }
         /* Read the super block, root inode, and clear open file data structure */
-        sfs_read_super(disk);
-        sfs_read_inode(disk, 0, &disk->root_dir_inode);
+        if(sfs_read_super(disk) != 0) {
+                printf("ERROR: super block is corrupt!\n");
+                return -1;
+        }
+        int error = sfs_read_inode(disk, 0, &disk->root_dir_inode);
         disk->open_files=0;
         for(int i=0; i < SFS_MAX_OPEN_FILES; i++) {
                 disk->open_list[i].used = 0;
         }
+        sfs_dedup_rebuild(disk);
+        if(error) {
+                printf("ERROR: root directory inode is corrupt!\n");
+                return -1;
+        }
         return 0;
 }
 
+/* Read the super block into disk->super. csum_start is read first, so with
+ * checksums on the block is checked as soon as it is known.
+ * Returns 0, or -1 on failure. */
 int sfs_read_super(struct sfs_disk* disk)
 {
         struct sfs_super* super = &disk->super;
-        disk_read(disk->data, 0, 0, &super->magic, 2);
+        disk_read(disk, 0, 0, &super->magic, 2);
         if(super->magic != SFS_MAGIC) {
                 printf("Super block has invalid magic number! %d\n", super->magic);
                 return -1;
         }
-        disk_read(disk->data, 0, 2, &super->inode_blocks, 1);
-        disk_read(disk->data, 0, 3, &super->data_blocks, 1);
-        disk_read(disk->data, 0, 4, &super->used_inodes, 1);
-        disk_read(disk->data, 0, 5, &super->used_data, 1);
-
+        if(disk_read(disk, 0, 7, &super->csum_start, 1) != 0) return -1;
+        disk_read(disk, 0, 2, &super->inode_blocks, 1);
+        disk_read(disk, 0, 3, &super->data_blocks, 1);
+        disk_read(disk, 0, 4, &super->used_inodes, 1);
+        disk_read(disk, 0, 5, &super->used_data, 1);
+        disk_read(disk, 0, 6, &super->flags, 1);
+        disk_read(disk, 0, SFS_INIT_MAP_START, &super->init_map, 1);
+        if((super->init_map & 1) == 0) {
+                super->init_map = 0xff; // formatted before lazy init, so fully initialized
+        }
+        for(int i=0; i < SFS_MAX_SNAPSHOTS; i++) {
+                disk_read(disk, 0, SFS_SNAPSHOT_START + i*SFS_SNAPSHOT_SIZE,
+                        &super->snapshot[i], sizeof(struct sfs_snapshot));
+        }
         return 0;
 }
 
 int sfs_write_super(struct sfs_disk* disk, struct sfs_super* super)
 {
-        disk_write(disk->data, 0, 0, &super->magic, 2);
-        disk_write(disk->data, 0, 2, &super->inode_blocks, 1);
-        disk_write(disk->data, 0, 3, &super->data_blocks, 1);
-        disk_write(disk->data, 0, 4, &super->used_inodes, 1);
-        disk_write(disk->data, 0, 5, &super->used_data, 1);
+        disk_write(disk, 0, 0, &super->magic, 2);
+        disk_write(disk, 0, 2, &super->inode_blocks, 1);
+        disk_write(disk, 0, 3, &super->data_blocks, 1);
+        disk_write(disk, 0, 4, &super->used_inodes, 1);
+        disk_write(disk, 0, 5, &super->used_data, 1);
+        disk_write(disk, 0, 6, &super->flags, 1);
+        disk_write(disk, 0, 7, &super->csum_start, 1);
+        disk_write(disk, 0, SFS_INIT_MAP_START, &super->init_map, 1);
+        for(int i=0; i < SFS_MAX_SNAPSHOTS; i++) {
+                disk_write(disk, 0, SFS_SNAPSHOT_START + i*SFS_SNAPSHOT_SIZE,
+                        &super->snapshot[i], sizeof(struct sfs_snapshot));
+        }
         return 0;
 }
 
@@ -89,17 +225,115 @@ void sfs_print_super(struct sfs_super* super)
         printf("  Data blocks:  %"PRIu8"\n", super->data_blocks);
         printf("  Inodes used:  %"PRIu8"\n", super->used_inodes);
         printf("  Data used:    %"PRIu8"\n", super->used_data);
+        printf("  Flags:        %"PRIu8"\n", super->flags);
+        printf("  Checksums:    %"PRIu8"\n", super->csum_start);
+        printf("  Initialized:  0x%02"PRIx8"\n", super->init_map);
 }
 
-/* Return the next free data block, or 0 on error. */
+/* Return the next free data block, or 0 on error. The block is returned with
+ * a reference count of 1. */
 uint8_t sfs_get_free_block(struct sfs_disk* disk)
 {
         // Note: sfs_format reserves block 0 and sets used_blocks to 1
-        /* TODO: Need to add a free bitmap for data blocks...
-         * This returns a raw block address not currently in use.
+        /* A data block is free when its reference count is 0.
          * SFS_DATA_BLOCK_START is reserved for the root directory */
-        disk->super.used_data++;
-        return SFS_DATA_BLOCK_START + disk->super.used_data - 1;
+        for(int block=SFS_DATA_BLOCK_START; block < SFS_NUM_BLOCKS; block++) {
+                int ref = sfs_get_ref(disk, block);
+                if(ref < 0) return 0; // the free map is corrupt
+                if(ref == 0) {
+                        if(disk->super.flags & SFS_FLAG_DEDUP) {
+                                sfs_dedup_remove(disk, block); // forget its old contents
+                        }
+                        if(sfs_ref_block(disk, block) != 0) return 0;
+                        return block;
+                }
+        }
+        printf("ERROR: no free data blocks left!\n");
+        return 0;
+}
+
+/* Return 1 if the `n` blocks starting at `start` are all free data blocks,
+ * or -1 if the free map is corrupt. */
+static int sfs_run_is_free(struct sfs_disk* disk, int start, int n)
+{
+        if(start < SFS_DATA_BLOCK_START || start + n > SFS_NUM_BLOCKS) return 0;
+        for(int block=start; block < start + n; block++) {
+                int ref = sfs_get_ref(disk, block);
+                if(ref != 0) return ref < 0 ? -1 : 0;
+        }
+        return 1;
+}
+
+/* Return the first of `n` consecutive free data blocks, or 0 if there is no
+ * such run. The run starting at `hint` is used if it is free, so a file can
+ * keep growing in place. The blocks are returned with a reference count of 1. */
+uint8_t sfs_get_free_run(struct sfs_disk* disk, int n, int hint)
+{
+        int free = sfs_run_is_free(disk, hint, n);
+        int start = free == 1 ? hint : 0;
+        for(int block=SFS_DATA_BLOCK_START; start == 0 && free >= 0 && block + n <= SFS_NUM_BLOCKS; block++) {
+                free = sfs_run_is_free(disk, block, n);
+                if(free == 1) start = block;
+        }
+        if(start == 0) return 0;
+        for(int block=start; block < start + n; block++) {
+                if(disk->super.flags & SFS_FLAG_DEDUP) {
+                        sfs_dedup_remove(disk, block); // forget its old contents
+                }
+                sfs_ref_block(disk, block);
+        }
+        return start;
+}
+
+/* Return the number of inodes (or snapshots) referencing a data block, or -1
+ * if the free map block holding the count failed its checksum. */
+int sfs_get_ref(struct sfs_disk* disk, int block)
+{
+        uint8_t ref;
+        if(disk_read(disk, SFS_REFCOUNT_BLOCK_START + block / SFS_BLOCK_SIZE,
+                block % SFS_BLOCK_SIZE, &ref, 1) != 0) return -1;
+        return ref;
+}
+
+/* Add a reference to a data block, marking it used if it was free.
+ * Returns 0, or -1 if the block already has SFS_MAX_REFS references or the
+ * free map is corrupt. */
+int sfs_ref_block(struct sfs_disk* disk, int block)
+{
+        int ref = sfs_get_ref(disk, block);
+        if(ref < 0) return -1;
+        if(ref == SFS_MAX_REFS) {
+                printf("ERROR: block %d has too many references!\n", block);
+                return -1;
+        }
+        uint8_t count = ref + 1;
+        disk_write(disk, SFS_REFCOUNT_BLOCK_START + block / SFS_BLOCK_SIZE,
+                block % SFS_BLOCK_SIZE, &count, 1);
+        if(count == 1) {
+                disk->super.used_data++;
+                sfs_write_super(disk, &disk->super);
+        }
+        return 0;
+}
+
+/* Drop a reference to a data block, freeing it once nothing uses it.
+ * Returns 0, or -1 if the block is unused or the free map is corrupt. */
+int sfs_unref_block(struct sfs_disk* disk, int block)
+{
+        int ref = sfs_get_ref(disk, block);
+        if(ref < 0) return -1;
+        if(ref == 0) {
+                printf("ERROR: tried to free unused block %d\n", block);
+                return -1;
+        }
+        uint8_t count = ref - 1;
+        disk_write(disk, SFS_REFCOUNT_BLOCK_START + block / SFS_BLOCK_SIZE,
+                block % SFS_BLOCK_SIZE, &count, 1);
+        if(count == 0) {
+                disk->super.used_data--;
+                sfs_write_super(disk, &disk->super);
+        }
+        return 0;
 }
 
 
@@ -115,9 +349,85 @@ uint8_t sfs_get_free_inode_index(struct sfs_disk* disk)
         return disk->super.used_inodes++;
 }
 
+/* Return 1 if a delta on top of dump `parent` can't be restored after
+ * dump_file_name is written: dump_file_name is `parent` or one of the dumps
+ * under it, or the chain is broken or already as long as it can be. */
+static int sfs_dump_needs_full(char* parent, char* dump_file_name)
+{
+        struct sfs_dump_header header;
+        char path[SFS_DUMP_NAME_LENGTH];
+        snprintf(path, SFS_DUMP_NAME_LENGTH, "%s", parent);
+        for(int depth=0; depth < SFS_MAX_DUMP_CHAIN; depth++) {
+                if(strcmp(path, dump_file_name) == 0) return 1;
+                FILE* f = fopen(path, "rb");
+                if(f == NULL) return 1;
+                int ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == SFS_DUMP_MAGIC;
+                fclose(f);
+                if(!ok) return 1;
+                if(header.parent[0] == 0) return 0; // reached the full dump
+                memcpy(path, header.parent, SFS_DUMP_NAME_LENGTH);
+                path[SFS_DUMP_NAME_LENGTH - 1] = 0;
+        }
+        return 1;
+}
+
+/* Pick an id for a new dump, different from the last one. */
+static uint32_t sfs_dump_new_id(struct sfs_disk* disk)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint32_t seed[4] = { (uint32_t)ts.tv_sec, (uint32_t)ts.tv_nsec, disk->dump_id, (uint32_t)getpid() };
+        uint32_t id = sfs_crc32c(seed, sizeof(seed));
+        return id == 0 || id == disk->dump_id ? id + 1 : id;
+}
+
 /* Dump the contents of the file system to a file on disk. Return 0 on succes,
- * or -1 on failure.*/
+ * or -1 on failure.
+ * The first dump saves every block. After that each dump is a delta holding
+ * only the blocks disk_write touched since the previous dump, which it names
+ * as its parent. Keep every file in the chain: mounting the latest one
+ * restores its whole chain. A dump that would overwrite a file its own chain
+ * depends on (say, alternating between two files) is written in full
+ * instead. The dump is written to a temporary file and renamed into place,
+ * so a failed dump leaves the old file alone. */
 int sfs_dump(struct sfs_disk* disk, char* dump_file_name) {
-        // TODO: dump disk->data to a file so it can be reloaded and mounted later
-        return -1;
+        struct sfs_dump_header header;
+        char buf[SFS_BLOCK_SIZE];
+        char tmp[SFS_DUMP_NAME_LENGTH + 4];
+        sfs_csum_flush(disk);
+        int full = disk->dump_name[0] == 0 || sfs_dump_needs_full(disk->dump_name, dump_file_name);
+        memset(&header, 0, sizeof(header));
+        header.magic = SFS_DUMP_MAGIC;
+        header.id = sfs_dump_new_id(disk);
+        if(!full) {
+                snprintf(header.parent, SFS_DUMP_NAME_LENGTH, "%s", disk->dump_name);
+                header.parent_id = disk->dump_id;
+        }
+        for(int block=0; block < SFS_NUM_BLOCKS; block++) {
+                if(full || (disk->dirty[block / 8] & (1 << (block % 8)))) header.blocks++;
+        }
+        snprintf(tmp, sizeof(tmp), "%s.tmp", dump_file_name);
+        FILE* f = fopen(tmp, "wb");
+        if(f == NULL) {
+                printf("ERROR: can't create dump %s\n", dump_file_name);
+                return -1;
+        }
+        int error = fwrite(&header, sizeof(header), 1, f) != 1;
+        for(uint16_t block=0; block < SFS_NUM_BLOCKS && !error; block++) {
+                if(!full && (disk->dirty[block / 8] & (1 << (block % 8))) == 0) continue;
+                if(disk_read(disk, block, 0, buf, SFS_BLOCK_SIZE) != 0) { // don't back up corruption
+                        error = 1;
+                        break;
+                }
+                error = fwrite(&block, sizeof(block), 1, f) != 1 || fwrite(buf, SFS_BLOCK_SIZE, 1, f) != 1;
+        }
+        if(fclose(f) != 0 || error || rename(tmp, dump_file_name) != 0) {
+                printf("ERROR: write to dump %s failed\n", dump_file_name);
+                unlink(tmp);
+                return -1;
+        }
+        memset(disk->dirty, 0, sizeof(disk->dirty));
+        snprintf(disk->dump_name, SFS_DUMP_NAME_LENGTH, "%s", dump_file_name);
+        disk->dump_id = header.id;
+        return 0;
 }
@@ -3,9 +3,12 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #include "disk.h"
 #include "sfs.h"
+#include "workload.h"
 
 int test_mount_and_format(struct sfs_disk* disk) {
         int ret, error = 0;
@@ -154,9 +157,918 @@ int test_open_write_seek_read(struct sfs_disk* disk)
         return error;
 }
 
+int test_snapshot_and_clone(struct sfs_disk* disk)
+{
+        int error = 0;
+        char* string = (char*) malloc(300);
+        char* string2 = (char*) malloc(300);
+        printf("\n-------------------------------------------\n");
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        memset(string, 'x', 300);
+        int fd = sfs_open(disk, "snapfile", 1);
+        sfs_write(disk, fd, string, 300);
+        sfs_close(disk, fd);
+
+        // a clone shares every data block with the original
+        int used = disk->super.used_data;
+        if(sfs_clone(disk, "snapfile", "snapclone") != 0 || disk->super.used_data != used) {
+                printf("ERROR: clone copied data blocks\n");
+                error = 1;
+        }
+        // a snapshot only copies the inode table, however big the files are
+        used = disk->super.used_data;
+        clock_t start = clock();
+        int id = sfs_snapshot(disk);
+        printf("Snapshot took %.3f ms\n", (double)(clock() - start) * 1000 / CLOCKS_PER_SEC);
+        if(id < 0 || disk->super.used_data - used != SFS_INODE_BLOCKS) {
+                printf("ERROR: snapshot used %d blocks\n", disk->super.used_data - used);
+                error = 1;
+        }
+        // writing to a shared block copies only that block
+        used = disk->super.used_data;
+        fd = sfs_open(disk, "snapfile", 0);
+        sfs_write(disk, fd, "yyyyyyyyyy", 10);
+        sfs_close(disk, fd);
+        if(disk->super.used_data - used != 1) {
+                printf("ERROR: write copied %d blocks\n", disk->super.used_data - used);
+                error = 1;
+        }
+        fd = sfs_open(disk, "snapclone", 0);
+        if(sfs_read(disk, fd, string2, 300) != 300 || memcmp(string, string2, 300) != 0) {
+                printf("ERROR: write to original changed the clone\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // restoring the snapshot brings back the original contents
+        if(sfs_snapshot_restore(disk, id) != 0) {
+                printf("ERROR: snapshot restore failed\n");
+                error = 1;
+        }
+        fd = sfs_open(disk, "snapfile", 0);
+        if(sfs_read(disk, fd, string2, 300) != 300 || memcmp(string, string2, 300) != 0) {
+                printf("ERROR: restored file doesn't match snapshot\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        if(sfs_snapshot_delete(disk, id) != 0) {
+                printf("ERROR: snapshot delete failed\n");
+                error = 1;
+        }
+        if(error) {
+                printf("# test_snapshot_and_clone FAILED\n");
+        }
+        else {
+                printf("# test_snapshot_and_clone PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
+int test_compressed_file(struct sfs_disk* disk)
+{
+        int error = 0;
+        int size = 4000; // more than fits in an uncompressed file
+        char* string = (char*) malloc(size);
+        char* string2 = (char*) malloc(size);
+        printf("\n-------------------------------------------\n");
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        fill_log_lines(string, size);
+        int fd = sfs_open(disk, "log", SFS_CREATE_COMPRESSED);
+        if(sfs_write(disk, fd, string, size) != size) {
+                printf("ERROR: compressed write failed\n");
+                error = 1;
+        }
+        printf("Compressed %d bytes into %d blocks\n", size, fd >= 0 ? disk->open_list[fd].inode.used_blocks : 0);
+        // overwrite the middle of the file, then read back a random range
+        memcpy(string + 1500, "OVERWRITTEN", 11);
+        sfs_seek(disk, fd, 1500, SEEK_SET);
+        sfs_write(disk, fd, "OVERWRITTEN", 11);
+        sfs_close(disk, fd);
+        fd = sfs_open(disk, "log", 0);
+        sfs_seek(disk, fd, 1490, SEEK_SET);
+        if(sfs_read(disk, fd, string2, 100) != 100 || memcmp(string + 1490, string2, 100) != 0) {
+                printf("ERROR: random read from compressed file doesn't match\n");
+                error = 1;
+        }
+        sfs_seek(disk, fd, 0, SEEK_SET);
+        if(sfs_read(disk, fd, string2, size) != size || memcmp(string, string2, size) != 0) {
+                printf("ERROR: read from compressed file doesn't match\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // an extent only this file uses is rewritten in place, a shared one is copied
+        sfs_clone(disk, "log", "logclone");
+        fd = sfs_open(disk, "log", 0);
+        uint8_t first = disk->open_list[fd].inode.block[1];
+        sfs_write(disk, fd, string, 100);
+        if(disk->open_list[fd].inode.block[1] == first) {
+                printf("ERROR: write changed an extent shared with a clone\n");
+                error = 1;
+        }
+        first = disk->open_list[fd].inode.block[1];
+        sfs_seek(disk, fd, 0, SEEK_SET);
+        sfs_write(disk, fd, string, 100);
+        if(disk->open_list[fd].inode.block[1] != first) {
+                printf("ERROR: unshared extent wasn't rewritten in place\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        fd = sfs_open(disk, "logclone", 0);
+        if(sfs_read(disk, fd, string2, size) != size || memcmp(string, string2, size) != 0) {
+                printf("ERROR: read from compressed clone doesn't match\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // formatting with SFS_FLAG_COMPRESS compresses every new file
+        sfs_format_flags(disk, SFS_FLAG_COMPRESS);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "log", 1);
+        if(fd < 0 || disk->open_list[fd].inode.type != 3) {
+                printf("ERROR: file on compressed image isn't compressed\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        if(error) {
+                printf("# test_compressed_file FAILED\n");
+        }
+        else {
+                printf("# test_compressed_file PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
+int test_dedup(struct sfs_disk* disk)
+{
+        int error = 0;
+        char* string = (char*) malloc(400);
+        char* string2 = (char*) malloc(400);
+        char name[SFS_NAME_LENGTH];
+        printf("\n-------------------------------------------\n");
+        sfs_format_flags(disk, SFS_FLAG_DEDUP);
+        sfs_mount(disk, NULL);
+        memset(string, 'a', 399);
+        string[399] = '\0';
+        // three full blocks of a's per file share one block, the partial last block doesn't
+        for(int i=0; i < 3; i++) {
+                snprintf(name, sizeof(name), "dup%d", i);
+                int fd = sfs_open(disk, name, 1);
+                sfs_write(disk, fd, string, 400);
+                sfs_close(disk, fd);
+        }
+        printf("3 files of 4 blocks use %d data blocks\n", disk->super.used_data - 1);
+        if(disk->super.used_data - 1 != 4) {
+                printf("ERROR: identical blocks weren't shared\n");
+                error = 1;
+        }
+        // changing a shared block leaves the other files alone
+        int fd = sfs_open(disk, "dup0", 0);
+        sfs_write(disk, fd, "bbbb", 4);
+        sfs_close(disk, fd);
+        fd = sfs_open(disk, "dup1", 0);
+        if(sfs_read(disk, fd, string2, 400) != 400 || memcmp(string, string2, 400) != 0) {
+                printf("ERROR: write to deduplicated block changed another file\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // the index is rebuilt when the disk is mounted again
+        sfs_mount(disk, NULL);
+        int used = disk->super.used_data;
+        fd = sfs_open(disk, "dup3", 1);
+        sfs_write(disk, fd, string, 400);
+        sfs_close(disk, fd);
+        if(disk->super.used_data - used != 1) {
+                printf("ERROR: dedup index wasn't rebuilt at mount\n");
+                error = 1;
+        }
+        // once a block has SFS_MAX_REFS references, further copies share a new block
+        int len = SFS_BLOCKS_PER_INODE * SFS_BLOCK_SIZE;
+        char* full = (char*) malloc(len);
+        char* full2 = (char*) malloc(len);
+        struct sfs_dir_entry entry;
+        struct sfs_inode inode;
+        sfs_format_flags(disk, SFS_FLAG_DEDUP);
+        sfs_mount(disk, NULL);
+        memset(full, 'z', len);
+        for(int i=0; i < 10; i++) { // 280 copies of the same block
+                snprintf(name, sizeof(name), "f%d", i);
+                fd = sfs_open(disk, name, 1);
+                sfs_write(disk, fd, full, len);
+                sfs_close(disk, fd);
+        }
+        sfs_find_dir_entry(disk, "f0", &entry);
+        sfs_read_inode(disk, entry.inum, &inode);
+        printf("280 copies of a block use %d data blocks\n", disk->super.used_data - 2);
+        // two shared blocks, plus the root directory's two blocks
+        if(sfs_get_ref(disk, inode.block[0]) != SFS_MAX_REFS || disk->super.used_data != 4) {
+                printf("ERROR: block has %d references\n", sfs_get_ref(disk, inode.block[0]));
+                error = 1;
+        }
+        // dropping f0's references must not free blocks the other files use
+        memset(full2, 'B', len);
+        fd = sfs_open(disk, "f0", 0);
+        sfs_write(disk, fd, full2, len);
+        sfs_close(disk, fd);
+        fd = sfs_open(disk, "f5", 0);
+        if(sfs_read(disk, fd, full2, len) != len || memcmp(full, full2, len) != 0) {
+                printf("ERROR: overwriting a file changed another file sharing its blocks\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        free(full);
+        free(full2);
+        if(error) {
+                printf("# test_dedup FAILED\n");
+        }
+        else {
+                printf("# test_dedup PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
+int test_file_backend(struct sfs_disk* disk)
+{
+        int error = 0;
+        int size = 3000;
+        char* string = (char*) malloc(size);
+        char* string2 = (char*) malloc(size);
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, size);
+        if(sfs_backend_open(disk, "test.img", 1) != 0) {
+                printf("# test_file_backend FAILED\n");
+                return 1;
+        }
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        int fd = sfs_open(disk, "backed", 1);
+        sfs_write(disk, fd, string, size);
+        sfs_close(disk, fd);
+        sfs_backend_close(disk);
+        // start over from the image file with an empty cache
+        memset(disk->data, 0, SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        sfs_backend_open(disk, "test.img", 1);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "backed", 0);
+        int reads = disk->device_reads;
+        int max_window = 0;
+        for(int off=0; off < size; off += 20) {
+                if(sfs_read(disk, fd, string2 + off, 20) != 20) {
+                        printf("ERROR: read from file backend failed\n");
+                        error = 1;
+                        break;
+                }
+                if(disk->open_list[fd].ra_window > max_window) max_window = disk->open_list[fd].ra_window;
+        }
+        // readers wait for the blocks being prefetched, so every read is counted by now
+        int used_blocks = disk->open_list[fd].inode.used_blocks;
+        printf("Read %d blocks with %d device reads\n", used_blocks, disk->device_reads - reads);
+        if(max_window <= SFS_RA_MIN_BLOCKS || disk->device_reads - reads >= used_blocks) {
+                printf("ERROR: sequential reads didn't use readahead\n");
+                error = 1;
+        }
+        if(memcmp(string, string2, size) != 0) {
+                printf("ERROR: read from file backend doesn't match\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // a random read stops readahead and only reads the block it needs
+        sfs_backend_close(disk);
+        memset(disk->data, 0, SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        sfs_backend_open(disk, "test.img", 1);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "backed", 0);
+        struct sfs_open_file* file = &disk->open_list[fd];
+        sfs_seek(disk, fd, 1500, SEEK_SET);
+        reads = disk->device_reads;
+        sfs_read(disk, fd, string2, 20);
+        if(file->ra_window != 0 || file->ra_end != 0 || disk->device_reads - reads != 1) {
+                printf("ERROR: random read started readahead\n");
+                error = 1;
+        }
+        sfs_read(disk, fd, string2, 20); // sequential again
+        if(file->ra_window != SFS_RA_MIN_BLOCKS) {
+                printf("ERROR: sequential read after a random one didn't start readahead\n");
+                error = 1;
+        }
+        sfs_seek(disk, fd, 0, SEEK_SET);
+        sfs_read(disk, fd, string2, 20);
+        if(file->ra_window != 0 || file->ra_end != 0) {
+                printf("ERROR: random read didn't reset readahead\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        sfs_backend_close(disk);
+        // checksums are in the image even if the process exits with a file open
+        if(fork() == 0) {
+                sfs_backend_open(disk, "test.img", 0);
+                sfs_format_flags(disk, SFS_FLAG_CHECKSUM_DATA);
+                sfs_mount(disk, NULL);
+                fd = sfs_open(disk, "unclosed", 1);
+                sfs_write(disk, fd, string, 300);
+                fflush(stdout);
+                _exit(0);
+        }
+        wait(NULL);
+        memset(disk->data, 0, SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        sfs_backend_open(disk, "test.img", 0);
+        if(sfs_mount(disk, NULL) != 0 || (fd = sfs_open(disk, "unclosed", 0)) < 0
+                || sfs_read(disk, fd, string2, 300) != 300 || memcmp(string, string2, 300) != 0) {
+                printf("ERROR: image written without closing its file is corrupt\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        sfs_backend_close(disk);
+        unlink("test.img");
+        if(error) {
+                printf("# test_file_backend FAILED\n");
+        }
+        else {
+                printf("# test_file_backend PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
+int test_delayed_allocation(struct sfs_disk* disk)
+{
+        int error = 0;
+        int fd[4];
+        char name[SFS_NAME_LENGTH];
+        char* string = (char*) malloc(600);
+        char* string2 = (char*) malloc(600);
+        struct sfs_dir_entry entry;
+        struct sfs_inode inode;
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, 600);
+        // four files written a little at a time each end up as one extent
+        sfs_format_flags(disk, SFS_FLAG_DELALLOC);
+        sfs_mount(disk, NULL);
+        for(int f=0; f < 4; f++) {
+                snprintf(name, sizeof(name), "writer%d", f);
+                fd[f] = sfs_open(disk, name, 1);
+        }
+        for(int off=0; off < 500; off += 50) {
+                for(int f=0; f < 4; f++) sfs_write(disk, fd[f], string + off, 50);
+        }
+        sfs_seek(disk, fd[0], 0, SEEK_SET);
+        if(sfs_read(disk, fd[0], string2, 500) != 500 || memcmp(string, string2, 500) != 0) {
+                printf("ERROR: read of unflushed data doesn't match\n");
+                error = 1;
+        }
+        for(int f=0; f < 4; f++) sfs_close(disk, fd[f]);
+        for(int f=0; f < 4; f++) {
+                snprintf(name, sizeof(name), "writer%d", f);
+                sfs_find_dir_entry(disk, name, &entry);
+                sfs_read_inode(disk, entry.inum, &inode);
+                if(inode.size != 500 || sfs_count_extents(&inode) != 1) {
+                        printf("ERROR: %s has %d extents\n", name, sfs_count_extents(&inode));
+                        error = 1;
+                }
+        }
+        // fallocate reserves contiguous space and it reads as zeros
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        fd[0] = sfs_open(disk, "prealloc", 1);
+        fd[1] = sfs_open(disk, "other", 1);
+        if(sfs_fallocate(disk, fd[0], 0, 600) != 0) {
+                printf("ERROR: fallocate failed\n");
+                error = 1;
+        }
+        for(int off=0; off < 500; off += 50) {
+                sfs_write(disk, fd[0], string + off, 50);
+                sfs_write(disk, fd[1], string + off, 50);
+        }
+        memset(string + 500, 0, 100);
+        sfs_seek(disk, fd[0], 0, SEEK_SET);
+        if(sfs_read(disk, fd[0], string2, 600) != 600 || memcmp(string, string2, 600) != 0) {
+                printf("ERROR: read of preallocated file doesn't match\n");
+                error = 1;
+        }
+        if(sfs_count_extents(&disk->open_list[fd[0]].inode) != 1) {
+                printf("ERROR: preallocated file is fragmented\n");
+                error = 1;
+        }
+        sfs_close(disk, fd[0]);
+        sfs_close(disk, fd[1]);
+        // close reports data it couldn't flush to a full disk
+        int len = SFS_BLOCKS_PER_INODE * SFS_BLOCK_SIZE;
+        char* full = (char*) calloc(1, len);
+        int ret = 0;
+        sfs_format_flags(disk, SFS_FLAG_DELALLOC);
+        sfs_mount(disk, NULL);
+        for(int f=0; f < 9 && ret == 0; f++) { // 9 full files don't fit
+                snprintf(name, sizeof(name), "big%d", f);
+                fd[0] = sfs_open(disk, name, 1);
+                sfs_write(disk, fd[0], full, len);
+                ret = sfs_close(disk, fd[0]);
+        }
+        if(ret != -1) {
+                printf("ERROR: close of a file that didn't fit returned %d\n", ret);
+                error = 1;
+        }
+        free(full);
+        if(error) {
+                printf("# test_delayed_allocation FAILED\n");
+        }
+        else {
+                printf("# test_delayed_allocation PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
+int test_async_ring(struct sfs_disk* disk)
+{
+        int error = 0;
+        int fd = -1;
+        char* string = (char*) malloc(400);
+        char reads[4][50];
+        struct sfs_sqe* sqe;
+        struct sfs_cqe cqe;
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, 400);
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        struct sfs_ring* ring = sfs_ring_init(disk, 4);
+        // open, then write, each waited on before the next depends on it
+        sqe = sfs_ring_get_sqe(ring);
+        sqe->op = SFS_OP_OPEN;
+        sqe->filename = "asyncfile";
+        sqe->create_flag = SFS_CREATE;
+        sqe->user_data = 100;
+        sfs_ring_submit(ring);
+        if(sfs_ring_wait_cqe(ring, &cqe) != 0 || cqe.user_data != 100 || cqe.result < 0) {
+                printf("ERROR: async open failed\n");
+                error = 1;
+        }
+        fd = cqe.result;
+        sqe = sfs_ring_get_sqe(ring);
+        sqe->op = SFS_OP_WRITE;
+        sqe->filedes = fd;
+        sqe->buf = string;
+        sqe->nbytes = 400;
+        sqe->user_data = 101;
+        sfs_ring_submit(ring);
+        if(sfs_ring_wait_cqe(ring, &cqe) != 0 || cqe.user_data != 101 || cqe.result != 400) {
+                printf("ERROR: async write failed\n");
+                error = 1;
+        }
+        // four reads at different offsets in one batch, matched up by tag
+        for(int i=0; i < 4; i++) {
+                sqe = sfs_ring_get_sqe(ring);
+                sqe->op = SFS_OP_READ;
+                sqe->filedes = fd;
+                sqe->buf = reads[i];
+                sqe->nbytes = 50;
+                sqe->offset = 300 - i * 100;
+                sqe->user_data = i;
+        }
+        if(sfs_ring_submit(ring) != 4) {
+                printf("ERROR: async submit didn't take all reads\n");
+                error = 1;
+        }
+        for(int i=0; i < 4; i++) {
+                if(sfs_ring_wait_cqe(ring, &cqe) != 0 || cqe.user_data > 3 || cqe.result != 50) {
+                        printf("ERROR: async read failed\n");
+                        error = 1;
+                        continue;
+                }
+                if(memcmp(reads[cqe.user_data], string + 300 - cqe.user_data * 100, 50) != 0) {
+                        printf("ERROR: async read %d doesn't match\n", (int)cqe.user_data);
+                        error = 1;
+                }
+        }
+        if(sfs_ring_peek_cqe(ring, &cqe) != -1 || sfs_ring_wait_cqe(ring, &cqe) != -1) {
+                printf("ERROR: async ring has extra completions\n");
+                error = 1;
+        }
+        // reads at an offset don't move the current offset, so this appends
+        sqe = sfs_ring_get_sqe(ring);
+        sqe->op = SFS_OP_WRITE;
+        sqe->filedes = fd;
+        sqe->buf = "appended";
+        sqe->nbytes = 8;
+        sfs_ring_submit(ring);
+        sfs_ring_wait_cqe(ring, &cqe);
+        sqe = sfs_ring_get_sqe(ring);
+        sqe->op = SFS_OP_READ;
+        sqe->filedes = fd;
+        sqe->buf = reads[0];
+        sqe->nbytes = 8;
+        sqe->offset = 400;
+        sfs_ring_submit(ring);
+        if(sfs_ring_wait_cqe(ring, &cqe) != 0 || cqe.result != 8 || memcmp(reads[0], "appended", 8) != 0) {
+                printf("ERROR: positioned reads moved the file offset\n");
+                error = 1;
+        }
+        sqe = sfs_ring_get_sqe(ring);
+        sqe->op = SFS_OP_CLOSE;
+        sqe->filedes = fd;
+        sfs_ring_submit(ring);
+        if(sfs_ring_wait_cqe(ring, &cqe) != 0 || cqe.result != 0) {
+                printf("ERROR: async close failed\n");
+                error = 1;
+        }
+        sfs_ring_exit(ring);
+        if(error) {
+                printf("# test_async_ring FAILED\n");
+        }
+        else {
+                printf("# test_async_ring PASSED\n");
+        }
+        free(string);
+        return error;
+}
+
+/* Size in bytes of the file at path, or -1 if it can't be opened. */
+long file_size(char* path)
+{
+        FILE* f = fopen(path, "rb");
+        if(f == NULL) return -1;
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fclose(f);
+        return size;
+}
+
+int test_incremental_dump(struct sfs_disk* disk)
+{
+        int error = 0;
+        int fd;
+        char* string = (char*) malloc(400);
+        char* string2 = (char*) malloc(400);
+        char* image = (char*) malloc(SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        long record = sizeof(uint16_t) + SFS_BLOCK_SIZE;
+        struct sfs_dir_entry entry;
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, 400);
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "dumpfile", SFS_CREATE);
+        sfs_write(disk, fd, string, 400);
+        sfs_close(disk, fd);
+        // the first dump saves every block
+        if(sfs_dump(disk, "test.dump0") != 0
+                || file_size("test.dump0") != (long)sizeof(struct sfs_dump_header) + SFS_NUM_BLOCKS * record) {
+                printf("ERROR: full dump failed\n");
+                error = 1;
+        }
+        // later dumps only save what changed: one data block and the inode block
+        fd = sfs_open(disk, "dumpfile", 0);
+        sfs_seek(disk, fd, 130, SEEK_SET);
+        sfs_write(disk, fd, "overwritten", 11);
+        memcpy(string + 130, "overwritten", 11);
+        sfs_close(disk, fd);
+        if(sfs_dump(disk, "test.dump1") != 0
+                || file_size("test.dump1") != (long)sizeof(struct sfs_dump_header) + 2 * record) {
+                printf("ERROR: delta dump saved %ld bytes\n", file_size("test.dump1"));
+                error = 1;
+        }
+        fd = sfs_open(disk, "second", SFS_CREATE);
+        sfs_write(disk, fd, string, 100);
+        sfs_close(disk, fd);
+        sfs_dump(disk, "test.dump2");
+        for(int block=0; block < SFS_NUM_BLOCKS; block++) {
+                disk_read(disk, block, 0, image + block*SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+        }
+        // mounting the last delta restores the whole chain
+        sfs_format(disk);
+        memset(disk->data, 0, SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        if(sfs_mount(disk, "test.dump2") != 0) {
+                printf("ERROR: mount from dump failed\n");
+                error = 1;
+        }
+        for(int block=0; block < SFS_NUM_BLOCKS; block++) {
+                disk_read(disk, block, 0, string2, SFS_BLOCK_SIZE);
+                if(memcmp(image + block*SFS_BLOCK_SIZE, string2, SFS_BLOCK_SIZE) != 0) {
+                        printf("ERROR: restored block %d doesn't match\n", block);
+                        error = 1;
+                }
+        }
+        fd = sfs_open(disk, "dumpfile", 0);
+        if(sfs_read(disk, fd, string2, 400) != 400 || memcmp(string, string2, 400) != 0) {
+                printf("ERROR: restored file doesn't match\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // a delta in the middle of the chain restores the disk as it was then
+        if(sfs_mount(disk, "test.dump1") != 0 || sfs_find_dir_entry(disk, "second", &entry) != -1) {
+                printf("ERROR: restoring an older delta failed\n");
+                error = 1;
+        }
+        unlink("test.dump0");
+        if(sfs_mount(disk, "test.dump2") != -1) {
+                printf("ERROR: mounted a delta without its parent\n");
+                error = 1;
+        }
+        unlink("test.dump1");
+        unlink("test.dump2");
+        // alternating between two files: the third dump would overwrite its own parent
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "dumpfile", SFS_CREATE);
+        sfs_write(disk, fd, string, 400);
+        sfs_close(disk, fd);
+        sfs_dump(disk, "test.dumpA");
+        fd = sfs_open(disk, "second", SFS_CREATE);
+        sfs_close(disk, fd);
+        sfs_dump(disk, "test.dumpB");
+        fd = sfs_open(disk, "third", SFS_CREATE);
+        sfs_close(disk, fd);
+        if(sfs_dump(disk, "test.dumpA") != 0
+                || file_size("test.dumpA") != (long)sizeof(struct sfs_dump_header) + SFS_NUM_BLOCKS * record) {
+                printf("ERROR: dump over its own parent wasn't a full dump\n");
+                error = 1;
+        }
+        if(sfs_mount(disk, "test.dumpA") != 0 || sfs_find_dir_entry(disk, "third", &entry) != 0) {
+                printf("ERROR: mount of alternating dump failed\n");
+                error = 1;
+        }
+        // B's parent is gone, so it must fail instead of restoring the wrong disk
+        if(sfs_mount(disk, "test.dumpB") != -1) {
+                printf("ERROR: mounted a delta whose parent was replaced\n");
+                error = 1;
+        }
+        unlink("test.dumpA");
+        unlink("test.dumpB");
+        if(error) {
+                printf("# test_incremental_dump FAILED\n");
+        }
+        else {
+                printf("# test_incremental_dump PASSED\n");
+        }
+        free(string);
+        free(string2);
+        free(image);
+        return error;
+}
+
+int test_readdir(struct sfs_disk* disk)
+{
+        int error = 0;
+        int fd, n, cursor = 0, total = 0;
+        int seen[12];
+        char name[SFS_NAME_LENGTH];
+        char* string = (char*) malloc(120);
+        struct sfs_dirent entries[5];
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, 120);
+        memset(seen, 0, sizeof(seen));
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        // 12 files and ./ take two directory blocks, each file i holds i*10 bytes
+        for(int i=0; i < 12; i++) {
+                snprintf(name, sizeof(name), "entry%d", i);
+                fd = sfs_open(disk, name, SFS_CREATE);
+                sfs_write(disk, fd, string, i * 10);
+                sfs_close(disk, fd);
+        }
+        while((n = sfs_readdir(disk, &disk->root_dir_inode, &cursor, entries, 5)) > 0) {
+                for(int j=0; j < n; j++) {
+                        int i;
+                        total++;
+                        if(strcmp(entries[j].name, "./") == 0) {
+                                if(entries[j].inum != 0 || entries[j].inode.type != 2) error = 1;
+                                continue;
+                        }
+                        if(sscanf(entries[j].name, "entry%d", &i) != 1 || i < 0 || i >= 12) {
+                                printf("ERROR: readdir returned unknown entry %s\n", entries[j].name);
+                                error = 1;
+                                continue;
+                        }
+                        seen[i]++;
+                        if(entries[j].inode.type != 1 || entries[j].inode.size != i * 10) {
+                                printf("ERROR: readdir returned the wrong inode for %s\n", entries[j].name);
+                                error = 1;
+                        }
+                }
+        }
+        if(n != 0 || total != 13) {
+                printf("ERROR: readdir returned %d entries\n", total);
+                error = 1;
+        }
+        for(int i=0; i < 12; i++) {
+                if(seen[i] != 1) {
+                        printf("ERROR: readdir returned entry%d %d times\n", i, seen[i]);
+                        error = 1;
+                }
+        }
+        sfs_ls_dir(disk, &disk->root_dir_inode);
+        if(error) {
+                printf("# test_readdir FAILED\n");
+        }
+        else {
+                printf("# test_readdir PASSED\n");
+        }
+        free(string);
+        return error;
+}
+
+int test_checksums(struct sfs_disk* disk)
+{
+        int error = 0;
+        int fd;
+        char* string = (char*) malloc(400);
+        char* string2 = (char*) malloc(400);
+        struct sfs_dir_entry entry;
+        struct sfs_inode inode;
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, 400);
+        if(sfs_crc32c("123456789", 9) != 0xE3069283) {
+                printf("ERROR: CRC32C of the check string is wrong\n");
+                error = 1;
+        }
+        // with data checksums, a corrupt data block fails the read after remounting
+        sfs_format_flags(disk, SFS_FLAG_CHECKSUM_DATA);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "checked", SFS_CREATE);
+        sfs_write(disk, fd, string, 400);
+        sfs_close(disk, fd);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "checked", 0);
+        if(sfs_read(disk, fd, string2, 400) != 400 || memcmp(string, string2, 400) != 0) {
+                printf("ERROR: read of checksummed file failed\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        sfs_find_dir_entry(disk, "checked", &entry);
+        sfs_read_inode(disk, entry.inum, &inode);
+        disk->data[inode.block[2] * SFS_BLOCK_SIZE + 5] ^= 1;
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "checked", 0);
+        if(sfs_read(disk, fd, string2, 400) != -1) {
+                printf("ERROR: read of a corrupt data block succeeded\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        disk->data[inode.block[2] * SFS_BLOCK_SIZE + 5] ^= 1;
+        // a corrupt block pointer in an inode is caught before it is followed
+        int inode_byte = SFS_INODE_BLOCK_START * SFS_BLOCK_SIZE + entry.inum * SFS_INODE_SIZE + 4;
+        disk->data[inode_byte] ^= 1;
+        if(sfs_mount(disk, NULL) != -1 || sfs_open(disk, "checked", 0) != -1) {
+                printf("ERROR: opened a file with a corrupt inode\n");
+                error = 1;
+        }
+        disk->data[inode_byte] ^= 1;
+        // a partial write to a corrupt block fails instead of checksumming the corruption
+        sfs_format_flags(disk, SFS_FLAG_CHECKSUM);
+        sfs_mount(disk, NULL);
+        for(int i=1; i <= 5; i++) {
+                snprintf(entry.name, SFS_NAME_LENGTH, "f%d", i);
+                fd = sfs_open(disk, entry.name, SFS_CREATE);
+                sfs_write(disk, fd, string, 10); // allocating a block saves used_inodes too
+                sfs_close(disk, fd);
+        }
+        inode_byte = SFS_INODE_BLOCK_START * SFS_BLOCK_SIZE + 5 * SFS_INODE_SIZE + 4;
+        disk->data[inode_byte] ^= 1;
+        sfs_mount(disk, NULL);
+        if(sfs_open(disk, "f6", SFS_CREATE) != -1) { // inode 6 shares a block with inode 5
+                printf("ERROR: wrote to a corrupt inode block\n");
+                error = 1;
+        }
+        sfs_mount(disk, NULL);
+        if(sfs_open(disk, "f5", 0) != -1) {
+                printf("ERROR: corruption was checksummed by a write to its block\n");
+                error = 1;
+        }
+        // a dump fails rather than back up a corrupt block
+        if(sfs_dump(disk, "test.dumpC") != -1 || access("test.dumpC", F_OK) == 0
+                || access("test.dumpC.tmp", F_OK) == 0) {
+                printf("ERROR: dumped a corrupt block\n");
+                error = 1;
+        }
+        unlink("test.dumpC");
+        disk->data[inode_byte] ^= 1;
+        // a corrupt super block fails the mount
+        disk->data[4] ^= 1;
+        if(sfs_mount(disk, NULL) != -1) {
+                printf("ERROR: mounted a corrupt super block\n");
+                error = 1;
+        }
+        disk->data[4] ^= 1;
+        // a corrupt refcount block stops writes instead of handing out used blocks
+        int ref_byte = SFS_REFCOUNT_BLOCK_START * SFS_BLOCK_SIZE + 100;
+        disk->data[ref_byte] ^= 1;
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "f1", 0);
+        if(fd < 0 || sfs_write(disk, fd, string, 10) != -1) {
+                printf("ERROR: wrote with a corrupt refcount block\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        disk->data[ref_byte] ^= 1;
+        // metadata only checksums leave data blocks unchecked
+        sfs_format_flags(disk, SFS_FLAG_CHECKSUM);
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "checked", SFS_CREATE);
+        sfs_write(disk, fd, string, 400);
+        sfs_close(disk, fd);
+        sfs_find_dir_entry(disk, "checked", &entry);
+        sfs_read_inode(disk, entry.inum, &inode);
+        disk->data[inode.block[2] * SFS_BLOCK_SIZE + 5] ^= 1;
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "checked", 0);
+        if(fd < 0 || sfs_read(disk, fd, string2, 400) != 400) {
+                printf("ERROR: metadata checksums checked a data block\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        if(error) {
+                printf("# test_checksums FAILED\n");
+        }
+        else {
+                printf("# test_checksums PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
+/* Returns 1 if every byte of a block in disk->data is zero. */
+int block_is_zero(struct sfs_disk* disk, int block)
+{
+        for(int i=0; i < SFS_BLOCK_SIZE; i++) {
+                if(disk->data[block*SFS_BLOCK_SIZE + i] != 0) return 0;
+        }
+        return 1;
+}
+
+int test_lazy_format(struct sfs_disk* disk)
+{
+        int error = 0;
+        int fd;
+        char name[SFS_NAME_LENGTH];
+        char* string = (char*) malloc(100);
+        char* string2 = (char*) malloc(100);
+        struct sfs_inode inode;
+        int last = SFS_DATA_BLOCK_START - 1; // last inode table block
+        int last_inode = SFS_INODE_BLOCKS * SFS_BLOCK_SIZE / SFS_INODE_SIZE - 1;
+        printf("\n-------------------------------------------\n");
+        fill_log_lines(string, 100);
+        // format leaves untouched metadata blocks alone, but they read as zeros
+        memset(disk->data, 0xab, SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
+        sfs_format(disk);
+        sfs_mount(disk, NULL);
+        sfs_read_inode(disk, last_inode, &inode);
+        if(block_is_zero(disk, last) || (disk->super.init_map & (1 << last)) != 0
+                || inode.type != 0 || inode.size != 0 || sfs_get_ref(disk, SFS_NUM_BLOCKS - 1) != 0) {
+                printf("ERROR: format didn't leave the inode table uninitialized\n");
+                error = 1;
+        }
+        // creating inodes 1-5 zeroes the second inode table block on first use
+        for(int i=0; i < 5; i++) {
+                snprintf(name, sizeof(name), "lazy%d", i);
+                fd = sfs_open(disk, name, SFS_CREATE);
+                sfs_write(disk, fd, string, 100);
+                sfs_close(disk, fd);
+        }
+        sfs_read_inode(disk, 7, &inode);
+        if((disk->super.init_map & (1 << (SFS_INODE_BLOCK_START + 1))) == 0 || inode.type != 0 || inode.size != 0) {
+                printf("ERROR: inode table block wasn't zeroed on first use\n");
+                error = 1;
+        }
+        sfs_mount(disk, NULL);
+        fd = sfs_open(disk, "lazy4", 0);
+        if(fd < 0 || sfs_read(disk, fd, string2, 100) != 100 || memcmp(string, string2, 100) != 0) {
+                printf("ERROR: read after remount doesn't match\n");
+                error = 1;
+        }
+        sfs_close(disk, fd);
+        // the background thread zeroes the rest
+        if(sfs_lazy_init_start(disk) != 0) error = 1;
+        sfs_lazy_init_wait(disk);
+        if(disk->super.init_map != 0xff || !block_is_zero(disk, last)) {
+                printf("ERROR: background init left blocks uninitialized\n");
+                error = 1;
+        }
+        sfs_mount(disk, NULL);
+        if(disk->super.init_map != 0xff) {
+                printf("ERROR: init map wasn't saved\n");
+                error = 1;
+        }
+        if(error) {
+                printf("# test_lazy_format FAILED\n");
+        }
+        else {
+                printf("# test_lazy_format PASSED\n");
+        }
+        free(string);
+        free(string2);
+        return error;
+}
+
 int main(int argc, char *argv[])
 {
         struct sfs_disk disk;
+        memset(&disk, 0, sizeof(disk));
         disk.data = (char *) malloc(SFS_NUM_BLOCKS*SFS_BLOCK_SIZE);
         if(disk.data == NULL) {
                 printf("Error allocating disk memory!\n");
@@ -182,5 +1094,26 @@ int main(int argc, char *argv[])
         // list the directory. This will only work once we have support for multiple files.
         sfs_ls_dir(&disk, &disk.root_dir_inode);
 
+        // snapshot the file system and clone a file without copying data
+        test_snapshot_and_clone(&disk);
+        // write and randomly read a compressed file
+        test_compressed_file(&disk);
+        // share identical blocks between files
+        test_dedup(&disk);
+        // store the disk in an image file and read it back with readahead
+        test_file_backend(&disk);
+        // interleaved writers with delayed allocation and fallocate
+        test_delayed_allocation(&disk);
+        // submit operations to the async ring and reap tagged completions
+        test_async_ring(&disk);
+        // dump only changed blocks and restore from a chain of deltas
+        test_incremental_dump(&disk);
+        // list a directory in batches with sfs_readdir
+        test_readdir(&disk);
+        // catch corrupt blocks with CRC32C checksums
+        test_checksums(&disk);
+        // format without zeroing the inode table up front
+        test_lazy_format(&disk);
+
         return 0;
 }
@@ -0,0 +1,23 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdio.h>
+#include <string.h>
+
+/* Sample data shared by the tests and benchmarks, so both run on the same
+ * workload. */
+
+/* Fill buf with log lines, which compress well. */
+static inline void fill_log_lines(char* buf, int len)
+{
+        char line[64];
+        int pos = 0;
+        for(int i=0; pos < len; i++) {
+                int n = snprintf(line, sizeof(line), "INFO request %d served in %d ms\n", i, i % 7);
+                if(n > len - pos) n = len - pos;
+                memcpy(buf + pos, line, n);
+                pos += n;
+        }
+}
+
+#endif